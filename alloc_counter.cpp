@@ -0,0 +1,47 @@
+#include "alloc_counter.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// The array and nothrow forms of the default operators forward to these ones.
+// Over-aligned allocations keep the library implementation and aren't counted.
+
+static std::atomic<std::uint64_t> allocations{ 0 };
+
+std::uint64_t allocation_count()
+{
+	return allocations.load(std::memory_order_relaxed);
+}
+
+void* operator new(std::size_t size)
+{
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	thread_allocations++;
+
+	if (size == 0)
+		size = 1;
+
+	while (true)
+	{
+		void* p = std::malloc(size);
+		if (p != nullptr)
+			return p;
+
+		std::new_handler handler = std::get_new_handler();
+		if (handler == nullptr)
+			throw std::bad_alloc();
+
+		handler();
+	}
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+	std::free(p);
+}
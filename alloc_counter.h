@@ -0,0 +1,108 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Number of operator new calls in the process so far, counted by the
+// replacement operators in alloc_counter.cpp.
+std::uint64_t allocation_count();
+
+// The same, for the calling thread.
+inline thread_local std::uint64_t thread_allocations{ 0 };
+
+// Allocations made to grow a buffer for a packet bigger than any before.
+inline std::atomic<std::uint64_t> growth_allocations{ 0 };
+
+// Counts the allocations this thread makes while the guard lives as buffer
+// growth. Wraps the code that may grow a buffer and nothing else that
+// allocates.
+class buffer_growth
+{
+	std::uint64_t start_;
+
+public:
+	buffer_growth() : start_(thread_allocations)
+	{
+	}
+
+	buffer_growth(const buffer_growth&) = delete;
+	buffer_growth& operator=(const buffer_growth&) = delete;
+
+	~buffer_growth()
+	{
+		if (thread_allocations != start_)
+			growth_allocations.fetch_add(thread_allocations - start_, std::memory_order_relaxed);
+	}
+};
+
+// Counts the allocations of the multiplexer's ticks once they are warmed up.
+// Data and restart ticks warm up separately, as they fill different buffers.
+// Buffers also grow later, when a packet is bigger than any before; the
+// allocations made under a buffer_growth guard are excused, and a tick that
+// made no others still counts as warm-up.
+class tick_allocations
+{
+	static const std::size_t warmup_ticks = 2;
+
+	std::uint64_t start_{ 0 };
+	std::uint64_t start_growth_{ 0 };
+	bool started_{ false };
+	std::size_t warmed_[2]{};
+	std::size_t ticks_{ 0 };
+	std::size_t growing_ticks_{ 0 };
+	std::size_t allocating_ticks_{ 0 };
+	std::uint64_t allocations_{ 0 };
+
+public:
+	// Ends the running tick, a restart one or not, and starts the next one.
+	void next(bool restart)
+	{
+		std::uint64_t now = allocation_count();
+		std::uint64_t growth = growth_allocations.load(std::memory_order_relaxed);
+
+		if (started_ && warmed_[restart ? 1 : 0]++ >= warmup_ticks)
+		{
+			ticks_++;
+
+			std::uint64_t made = now - start_;
+			std::uint64_t excused = std::min(made, growth - start_growth_);
+
+			if (made != excused)
+			{
+				allocating_ticks_++;
+				allocations_ += made - excused;
+			}
+			else if (made != 0)
+			{
+				growing_ticks_++;
+			}
+		}
+
+		started_ = true;
+		start_ = now;
+		start_growth_ = growth;
+	}
+
+	std::size_t ticks() const
+	{
+		return ticks_;
+	}
+
+	// Ticks that allocated only to grow buffers, not counted as allocating.
+	std::size_t growing_ticks() const
+	{
+		return growing_ticks_;
+	}
+
+	std::size_t allocating_ticks() const
+	{
+		return allocating_ticks_;
+	}
+
+	std::uint64_t allocations() const
+	{
+		return allocations_;
+	}
+};
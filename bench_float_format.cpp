@@ -0,0 +1,118 @@
+// Times the double formatting of outgoing batches: rapidjson's Writer::Double
+// against write_tasks and format_rows, for a few count x incount shapes.
+//
+//   make bench_float_format && ./bench_float_format
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include "float_format.h"
+
+using namespace rapidjson;
+
+struct bench_shape
+{
+	size_t count;
+	size_t incount;
+};
+
+// Runs f until about min_time has passed, returns the mean time of a run in ns.
+template <class F>
+static double time_runs(F f)
+{
+	using clock = std::chrono::steady_clock;
+	const auto min_time = std::chrono::milliseconds(300);
+
+	f();
+
+	size_t runs = 0;
+	auto start = clock::now();
+	auto now = start;
+
+	do
+	{
+		f();
+		runs++;
+		now = clock::now();
+	} while (now - start < min_time);
+
+	return std::chrono::duration<double, std::nano>(now - start).count() / runs;
+}
+
+static void fill_batch(task_batch& batch, size_t count, size_t incount, std::mt19937_64& rng)
+{
+	std::normal_distribution<double> values(0.0, 10.0);
+
+	batch.reset(count, incount);
+	for (size_t i = 0; i < count; i++)
+	{
+		double* row = batch.row(i);
+		for (size_t k = 0; k < incount; k++)
+			row[k] = values(rng);
+		batch.set_valid(i, true);
+	}
+}
+
+static void report(const char* name, const bench_shape& shape, double ns, size_t chars)
+{
+	double n = static_cast<double>(shape.count * shape.incount);
+	std::printf("%-14s %6zu x %-5zu %10.1f us %8.2f ns/value %8.1f MB/s\n", name,
+		shape.count, shape.incount, ns / 1000.0, ns / n, chars * 1000.0 / ns);
+}
+
+int main()
+{
+	const bench_shape shapes[] = { { 16, 8 }, { 64, 32 }, { 256, 64 }, { 1024, 128 }, { 32, 1024 } };
+
+	std::mt19937_64 rng(42);
+	task_batch batch;
+	StringBuffer s;
+	json_rows rows;
+
+	for (auto& shape : shapes)
+	{
+		fill_batch(batch, shape.count, shape.incount, rng);
+
+		double ns = time_runs([&]() {
+			s.Clear();
+			Writer<StringBuffer> doc(s);
+			doc.StartArray();
+			for (size_t i = 0; i < batch.rows(); i++)
+			{
+				doc.StartArray();
+				const double* row = batch.row(i);
+				for (size_t k = 0; k < batch.width(); k++)
+					doc.Double(row[k]);
+				doc.EndArray();
+			}
+			doc.EndArray();
+		});
+		report("rapidjson", shape, ns, s.GetSize());
+
+		ns = time_runs([&]() {
+			s.Clear();
+			Writer<StringBuffer> doc(s);
+			write_tasks(doc, s, batch, 0, true);
+		});
+		report("write_tasks", shape, ns, s.GetSize());
+
+		ns = time_runs([&]() {
+			format_rows(rows, batch, batch.rows(), batch.width(), 0);
+		});
+		report("format_rows", shape, ns, rows.text.size());
+
+		ns = time_runs([&]() {
+			format_rows(rows, batch, batch.rows(), batch.width(), 6);
+		});
+		report("format_rows/6", shape, ns, rows.text.size());
+
+		std::printf("\n");
+	}
+
+	return 0;
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+// Binary data packets, used instead of JSON once both sides agreed on the
+// "binary" encoding in the start info exchange. All fields are little-endian:
+//
+//   u32 magic "MENB" | u16 packet type | u16 head | u32 count | u32 width |
+//   count * width doubles
+//
+// An e_send_info packet with the ok head sent to nlab carries the batch of all
+// environments: the header is followed by `count` mask bytes (1 for active
+// rows), zero-padded to a multiple of 8, and inactive rows are zero-filled.
+//
+// Senders append a '\0' after the doubles like after JSON text, so that
+// length framing can drop it; receivers accept the packet with or without it.
+// A packet is told apart from JSON by its first byte, which is never '{'.
+
+static const std::uint32_t binary_magic = 0x424e454d;
+static const std::size_t binary_header_size = 16;
+
+struct binary_header
+{
+	std::uint16_t type{ 0 };
+	std::uint16_t head{ 0 };
+	std::uint32_t count{ 0 };
+	std::uint32_t width{ 0 };
+};
+
+inline void write_le(char* pd, std::uint64_t v, std::size_t n)
+{
+	for (std::size_t i = 0; i < n; i++)
+	{
+		pd[i] = static_cast<char>(v >> (8 * i));
+	}
+}
+
+inline std::uint64_t read_le(const char* pd, std::size_t n)
+{
+	std::uint64_t v = 0;
+	for (std::size_t i = 0; i < n; i++)
+	{
+		v |= static_cast<std::uint64_t>(static_cast<unsigned char>(pd[i])) << (8 * i);
+	}
+	return v;
+}
+
+inline bool is_binary_packet(const char* pd, std::size_t sz)
+{
+	return sz >= binary_header_size && read_le(pd, 4) == binary_magic;
+}
+
+inline std::size_t binary_mask_size(std::size_t count)
+{
+	return (count + 7) & ~std::size_t(7);
+}
+
+inline std::size_t binary_packet_size(std::size_t count, std::size_t width, std::size_t mask = 0)
+{
+	if (count > UINT32_MAX || width > UINT32_MAX)
+		throw std::runtime_error("packet is too large for binary encoding");
+
+	return binary_header_size + mask + count * width * sizeof(double) + 1;
+}
+
+inline void write_binary_header(char* pd, const binary_header& hdr)
+{
+	write_le(pd, binary_magic, 4);
+	write_le(pd + 4, hdr.type, 2);
+	write_le(pd + 6, hdr.head, 2);
+	write_le(pd + 8, hdr.count, 4);
+	write_le(pd + 12, hdr.width, 4);
+}
+
+inline binary_header read_binary_header(const char* pd, std::size_t sz)
+{
+	binary_header hdr;
+	hdr.type = static_cast<std::uint16_t>(read_le(pd + 4, 2));
+	hdr.head = static_cast<std::uint16_t>(read_le(pd + 6, 2));
+	hdr.count = static_cast<std::uint32_t>(read_le(pd + 8, 4));
+	hdr.width = static_cast<std::uint32_t>(read_le(pd + 12, 4));
+
+	if (hdr.width != 0 && hdr.count > (SIZE_MAX - binary_header_size - 1) / sizeof(double) / hdr.width)
+		throw std::runtime_error("binary packet size doesn't match its header");
+
+	std::size_t payload = static_cast<std::size_t>(hdr.count) * hdr.width * sizeof(double);
+	if (sz != binary_header_size + payload && sz != binary_header_size + payload + 1)
+		throw std::runtime_error("binary packet size doesn't match its header");
+
+	return hdr;
+}
+
+inline void write_doubles(char* pd, const double* values, std::size_t n)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	for (std::size_t i = 0; i < n; i++)
+	{
+		std::uint64_t v;
+		std::memcpy(&v, values + i, sizeof(v));
+		write_le(pd + i * sizeof(v), v, sizeof(v));
+	}
+#else
+	std::memcpy(pd, values, n * sizeof(double));
+#endif
+}
+
+inline void read_doubles(double* values, const char* pd, std::size_t n)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	for (std::size_t i = 0; i < n; i++)
+	{
+		std::uint64_t v = read_le(pd + i * sizeof(v), sizeof(v));
+		std::memcpy(values + i, &v, sizeof(v));
+	}
+#else
+	std::memcpy(values, pd, n * sizeof(double));
+#endif
+}
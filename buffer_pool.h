@@ -0,0 +1,261 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "alloc_counter.h"
+
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#endif
+
+class buffer_pool;
+
+// Owning handle to a buffer borrowed from buffer_pool. The storage returns to
+// the pool when the handle is reset or destroyed.
+class pooled_buffer
+{
+	buffer_pool* pool_{ nullptr };
+	char* data_{ nullptr };
+	std::size_t capacity_{ 0 };
+
+public:
+	pooled_buffer() = default;
+
+	explicit pooled_buffer(buffer_pool& pool) :
+		pool_(&pool)
+	{
+	}
+
+	pooled_buffer(const pooled_buffer&) = delete;
+	pooled_buffer& operator=(const pooled_buffer&) = delete;
+
+	pooled_buffer(pooled_buffer&& a) noexcept :
+		pool_(a.pool_), data_(a.data_), capacity_(a.capacity_)
+	{
+		a.data_ = nullptr;
+		a.capacity_ = 0;
+	}
+
+	pooled_buffer& operator=(pooled_buffer&& a) noexcept
+	{
+		if (this != &a)
+		{
+			reset();
+			pool_ = a.pool_;
+			data_ = a.data_;
+			capacity_ = a.capacity_;
+			a.data_ = nullptr;
+			a.capacity_ = 0;
+		}
+		return *this;
+	}
+
+	~pooled_buffer()
+	{
+		reset();
+	}
+
+	char* data() const
+	{
+		return data_;
+	}
+
+	std::size_t capacity() const
+	{
+		return capacity_;
+	}
+
+	// Makes the capacity at least sz, keeping the first `keep` bytes.
+	void reserve(std::size_t sz, std::size_t keep = 0);
+	void reset();
+};
+
+// Hands out reusable buffers rounded up to power-of-two size classes. Free
+// buffers are kept per class, so buffers are only allocated for the sizes
+// that the traffic actually needs. With huge pages enabled, classes of 2 MB
+// and larger are mapped with huge pages where the OS allows it.
+class buffer_pool
+{
+	static const std::size_t min_class_size = 4096;
+	static const std::size_t huge_page_size = 2 * 1024 * 1024;
+
+	std::mutex mutex_;
+	std::vector<std::vector<char*>> free_;
+	bool huge_pages_;
+
+	std::size_t in_use_{ 0 };
+	std::size_t peak_in_use_{ 0 };
+	std::size_t allocated_{ 0 };
+	std::size_t peak_allocated_{ 0 };
+
+	static std::size_t size_class(std::size_t sz, std::size_t& capacity);
+	char* allocate(std::size_t capacity);
+	void deallocate(char* p, std::size_t capacity);
+
+public:
+	explicit buffer_pool(bool huge_pages = false) :
+		huge_pages_(huge_pages)
+	{
+	}
+
+	buffer_pool(const buffer_pool&) = delete;
+	buffer_pool& operator=(const buffer_pool&) = delete;
+	~buffer_pool();
+
+	char* acquire(std::size_t sz, std::size_t& capacity);
+	void release(char* p, std::size_t capacity);
+
+	std::size_t peak_in_use()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		return peak_in_use_;
+	}
+
+	std::size_t peak_allocated()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		return peak_allocated_;
+	}
+};
+
+inline void pooled_buffer::reserve(std::size_t sz, std::size_t keep)
+{
+	if (sz <= capacity_)
+		return;
+
+	std::size_t capacity;
+	char* data = pool_->acquire(sz, capacity);
+
+	if (keep != 0)
+		std::memcpy(data, data_, keep);
+
+	reset();
+	data_ = data;
+	capacity_ = capacity;
+}
+
+inline void pooled_buffer::reset()
+{
+	if (data_)
+		pool_->release(data_, capacity_);
+
+	data_ = nullptr;
+	capacity_ = 0;
+}
+
+inline buffer_pool::~buffer_pool()
+{
+	for (std::size_t i = 0; i < free_.size(); i++)
+	{
+		for (auto p : free_[i])
+		{
+			deallocate(p, min_class_size << i);
+		}
+	}
+}
+
+inline std::size_t buffer_pool::size_class(std::size_t sz, std::size_t& capacity)
+{
+	std::size_t cls = 0;
+	capacity = min_class_size;
+
+	while (capacity < sz)
+	{
+		capacity <<= 1;
+		cls++;
+	}
+
+	return cls;
+}
+
+inline char* buffer_pool::allocate(std::size_t capacity)
+{
+#if !defined(_WIN32)
+	if (huge_pages_ && capacity >= huge_page_size)
+	{
+		void* p = nullptr;
+#if defined(MAP_HUGETLB)
+		p = mmap(nullptr, capacity, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+		if (p == nullptr || p == MAP_FAILED)
+		{
+			p = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (p == MAP_FAILED)
+				throw std::bad_alloc();
+#if defined(MADV_HUGEPAGE)
+			madvise(p, capacity, MADV_HUGEPAGE);
+#endif
+		}
+		return static_cast<char*>(p);
+	}
+#endif
+
+	return new char[capacity];
+}
+
+inline void buffer_pool::deallocate(char* p, std::size_t capacity)
+{
+#if !defined(_WIN32)
+	if (huge_pages_ && capacity >= huge_page_size)
+	{
+		munmap(p, capacity);
+		return;
+	}
+#endif
+
+	delete[] p;
+}
+
+inline char* buffer_pool::acquire(std::size_t sz, std::size_t& capacity)
+{
+	std::size_t cls = size_class(sz, capacity);
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (free_.size() <= cls)
+	{
+		buffer_growth growth;
+		free_.resize(cls + 1);
+	}
+
+	char* p;
+
+	if (!free_[cls].empty())
+	{
+		p = free_[cls].back();
+		free_[cls].pop_back();
+	}
+	else
+	{
+		buffer_growth growth;
+		p = allocate(capacity);
+		allocated_ += capacity;
+		if (allocated_ > peak_allocated_)
+			peak_allocated_ = allocated_;
+	}
+
+	in_use_ += capacity;
+	if (in_use_ > peak_in_use_)
+		peak_in_use_ = in_use_;
+
+	return p;
+}
+
+inline void buffer_pool::release(char* p, std::size_t capacity)
+{
+	std::size_t cls = size_class(capacity, capacity);
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	{
+		buffer_growth growth;
+		free_[cls].push_back(p);
+	}
+	in_use_ -= capacity;
+}
@@ -0,0 +1,312 @@
+#pragma once
+
+#include "event_loop.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+// Bounded queue for any number of producers and consumers, after D. Vyukov's
+// array-based design: a push or pop is one compare-and-swap on the position
+// plus a release store of the cell sequence, with no locks taken.
+template <class T>
+class mpmc_queue
+{
+	struct cell
+	{
+		std::atomic<size_t> sequence;
+		T value;
+	};
+
+	std::unique_ptr<cell[]> cells_;
+	size_t mask_;
+
+	alignas(64) std::atomic<size_t> push_pos_{ 0 };
+	alignas(64) std::atomic<size_t> pop_pos_{ 0 };
+
+public:
+	explicit mpmc_queue(size_t capacity)
+	{
+		size_t sz = 2;
+		while (sz < capacity)
+			sz *= 2;
+
+		cells_ = std::make_unique<cell[]>(sz);
+		mask_ = sz - 1;
+
+		for (size_t i = 0; i < sz; i++)
+			cells_[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	mpmc_queue(const mpmc_queue&) = delete;
+	mpmc_queue& operator=(const mpmc_queue&) = delete;
+
+	bool try_push(const T& value)
+	{
+		size_t pos = push_pos_.load(std::memory_order_relaxed);
+
+		while (true)
+		{
+			cell& c = cells_[pos & mask_];
+			size_t seq = c.sequence.load(std::memory_order_acquire);
+			auto diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+
+			if (diff == 0)
+			{
+				if (push_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				{
+					c.value = value;
+					c.sequence.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (diff < 0)
+			{
+				return false;
+			}
+			else
+			{
+				pos = push_pos_.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	bool try_pop(T& value)
+	{
+		size_t pos = pop_pos_.load(std::memory_order_relaxed);
+
+		while (true)
+		{
+			cell& c = cells_[pos & mask_];
+			size_t seq = c.sequence.load(std::memory_order_acquire);
+			auto diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos + 1);
+
+			if (diff == 0)
+			{
+				if (pop_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				{
+					value = std::move(c.value);
+					c.sequence.store(pos + mask_ + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (diff < 0)
+			{
+				return false;
+			}
+			else
+			{
+				pos = pop_pos_.load(std::memory_order_relaxed);
+			}
+		}
+	}
+};
+
+enum class codec_stage
+{
+	decode,
+	encode
+};
+
+// One env's parse or serialize step. The error of a failed step travels back
+// with the job and is rethrown on the loop thread.
+struct codec_job
+{
+	size_t index{ 0 };
+	codec_stage stage{ codec_stage::decode };
+	std::exception_ptr error;
+};
+
+// Runs the parse and serialize steps of the envs on a fixed set of threads,
+// while the loop thread keeps receiving, sending and assembling the batch.
+// Jobs and finished jobs are handed over through lock-free queues; an idle
+// worker spins for a while before it sleeps, and the loop thread is woken by
+// a single post however many jobs finish meanwhile.
+// push, pop and in_flight are called on the loop thread only.
+class codec_pool
+{
+	static const size_t spin_rounds = 1000;
+
+	event_loop& loop_;
+	std::function<void(const codec_job&)> work_;
+
+	mpmc_queue<codec_job> jobs_;
+	mpmc_queue<codec_job> done_;
+	std::atomic<size_t> queued_{ 0 };
+	std::atomic<size_t> finished_{ 0 };
+
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	std::atomic<size_t> sleeping_{ 0 };
+	std::atomic<bool> stopping_{ false };
+	std::vector<std::thread> threads_;
+
+	// Outlives the pool while a wake-up is still queued in the loop.
+	struct wake_state
+	{
+		std::atomic<bool> pending{ false };
+		handler_memory memory;
+	};
+
+	std::shared_ptr<wake_state> wake_;
+	std::optional<asio::io_service::work> work_guard_;
+	size_t in_flight_{ 0 };
+
+	void run();
+	void wake_loop();
+
+public:
+	// capacity is the most jobs ever in flight at once.
+	codec_pool(event_loop& loop, size_t threads, size_t capacity,
+		std::function<void(const codec_job&)> work);
+	codec_pool(const codec_pool&) = delete;
+	codec_pool& operator=(const codec_pool&) = delete;
+	~codec_pool();
+
+	void push(size_t index, codec_stage stage);
+
+	// Takes a finished job, if there is one.
+	bool pop(codec_job& job);
+
+	bool has_finished() const
+	{
+		return finished_.load(std::memory_order_acquire) != 0;
+	}
+
+	size_t in_flight() const
+	{
+		return in_flight_;
+	}
+};
+
+inline codec_pool::codec_pool(event_loop& loop, size_t threads, size_t capacity,
+	std::function<void(const codec_job&)> work)
+	: loop_(loop), work_(std::move(work)), jobs_(capacity), done_(capacity),
+	wake_(std::make_shared<wake_state>())
+{
+	if (threads == 0)
+		throw std::invalid_argument("codec pool needs at least one thread");
+
+	threads_.reserve(threads);
+	for (size_t i = 0; i < threads; i++)
+		threads_.emplace_back([this]() { run(); });
+}
+
+inline codec_pool::~codec_pool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stopping_ = true;
+	}
+
+	cv_.notify_all();
+
+	for (auto& t : threads_)
+		t.join();
+}
+
+inline void codec_pool::push(size_t index, codec_stage stage)
+{
+	codec_job job;
+	job.index = index;
+	job.stage = stage;
+
+	queued_.fetch_add(1);
+
+	if (!jobs_.try_push(job))
+	{
+		queued_.fetch_sub(1);
+		throw std::logic_error("codec pool: too many jobs in flight");
+	}
+
+	if (in_flight_++ == 0)
+		work_guard_.emplace(loop_.service());
+
+	if (sleeping_.load() != 0)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+		}
+
+		cv_.notify_one();
+	}
+}
+
+inline bool codec_pool::pop(codec_job& job)
+{
+	if (!done_.try_pop(job))
+		return false;
+
+	finished_.fetch_sub(1, std::memory_order_relaxed);
+
+	if (--in_flight_ == 0)
+		work_guard_.reset();
+
+	return true;
+}
+
+inline void codec_pool::wake_loop()
+{
+	if (wake_->pending.exchange(true))
+		return;
+
+	auto wake = wake_;
+	asio::post(loop_.service(), bind_memory(wake->memory, [wake]() {
+		wake->pending.store(false);
+	}));
+}
+
+inline void codec_pool::run()
+{
+	size_t idle = 0;
+
+	while (true)
+	{
+		codec_job job;
+
+		if (jobs_.try_pop(job))
+		{
+			queued_.fetch_sub(1);
+			idle = 0;
+
+			try
+			{
+				work_(job);
+			}
+			catch (...)
+			{
+				job.error = std::current_exception();
+			}
+
+			while (!done_.try_push(job))
+				std::this_thread::yield();
+
+			finished_.fetch_add(1, std::memory_order_release);
+			wake_loop();
+			continue;
+		}
+
+		if (stopping_.load())
+			return;
+
+		if (++idle < spin_rounds)
+		{
+			std::this_thread::yield();
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(mutex_);
+		sleeping_.fetch_add(1);
+		cv_.wait(lock, [this]() { return stopping_.load() || queued_.load() != 0; });
+		sleeping_.fetch_sub(1);
+		idle = 0;
+	}
+}
@@ -0,0 +1,320 @@
+#pragma once
+
+#define ASIO_STANDALONE
+#include <asio.hpp>
+#include <chrono>
+#include <cstddef>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+
+// How run_until waits for the next event:
+// block - sleep in the reactor right away;
+// hybrid - poll for the spin time, then poll and yield the core for the same time, then block;
+// spin - poll until done, never sleeping.
+enum class wait_policy
+{
+	block,
+	hybrid,
+	spin
+};
+
+inline wait_policy parse_wait_policy(const std::string& name)
+{
+	if (name == "block")
+		return wait_policy::block;
+	if (name == "hybrid")
+		return wait_policy::hybrid;
+	if (name == "spin")
+		return wait_policy::spin;
+
+	throw std::invalid_argument("unknown wait policy '" + name + "'");
+}
+
+struct wait_stats
+{
+	std::chrono::steady_clock::duration spin{};
+	std::chrono::steady_clock::duration yield{};
+	std::chrono::steady_clock::duration block{};
+	std::size_t spin_waits{ 0 };
+	std::size_t yield_waits{ 0 };
+	std::size_t block_waits{ 0 };
+};
+
+// Memory for the one pending wait of a stream, so that re-arming the wait every
+// tick doesn't allocate. Larger or overlapping requests go to the heap.
+class handler_memory
+{
+	alignas(std::max_align_t) unsigned char storage_[256];
+	bool in_use_{ false };
+
+public:
+	handler_memory() = default;
+	handler_memory(const handler_memory&) = delete;
+	handler_memory& operator=(const handler_memory&) = delete;
+
+	void* allocate(std::size_t size)
+	{
+		if (!in_use_ && size <= sizeof(storage_))
+		{
+			in_use_ = true;
+			return storage_;
+		}
+
+		return ::operator new(size);
+	}
+
+	void deallocate(void* p)
+	{
+		if (p == storage_)
+			in_use_ = false;
+		else
+			::operator delete(p);
+	}
+};
+
+template <class T>
+class handler_allocator
+{
+	template <class U> friend class handler_allocator;
+
+	handler_memory& memory_;
+
+public:
+	using value_type = T;
+
+	explicit handler_allocator(handler_memory& memory) noexcept
+		: memory_(memory)
+	{
+	}
+
+	template <class U>
+	handler_allocator(const handler_allocator<U>& a) noexcept
+		: memory_(a.memory_)
+	{
+	}
+
+	T* allocate(std::size_t n)
+	{
+		return static_cast<T*>(memory_.allocate(sizeof(T) * n));
+	}
+
+	void deallocate(T* p, std::size_t)
+	{
+		memory_.deallocate(p);
+	}
+
+	bool operator==(const handler_allocator& a) const noexcept
+	{
+		return &memory_ == &a.memory_;
+	}
+
+	bool operator!=(const handler_allocator& a) const noexcept
+	{
+		return &memory_ != &a.memory_;
+	}
+};
+
+// Handler whose operation state asio allocates from a handler_memory.
+template <class Handler>
+class memory_handler
+{
+	handler_memory& memory_;
+	Handler handler_;
+
+public:
+	using allocator_type = handler_allocator<Handler>;
+
+	memory_handler(handler_memory& memory, Handler handler)
+		: memory_(memory), handler_(std::move(handler))
+	{
+	}
+
+	allocator_type get_allocator() const noexcept
+	{
+		return allocator_type(memory_);
+	}
+
+	template <class... Args>
+	void operator()(Args&&... args)
+	{
+		handler_(std::forward<Args>(args)...);
+	}
+};
+
+template <class Handler>
+inline memory_handler<Handler> bind_memory(handler_memory& memory, Handler handler)
+{
+	return memory_handler<Handler>(memory, std::move(handler));
+}
+
+class event_loop
+{
+	using clock = std::chrono::steady_clock;
+
+	asio::io_service io_service_;
+	wait_policy policy_{ wait_policy::block };
+	std::chrono::microseconds spin_time_{ 50 };
+	wait_stats stats_;
+
+	void poll()
+	{
+		if (io_service_.stopped())
+			io_service_.restart();
+
+		if (io_service_.poll() == 0 && io_service_.stopped())
+			throw std::runtime_error("event loop has nothing to wait for");
+	}
+
+	template <class Predicate>
+	bool poll_until(Predicate done, clock::time_point end, bool yield)
+	{
+		do
+		{
+			if (yield)
+				std::this_thread::yield();
+
+			poll();
+
+			if (done())
+				return true;
+		} while (policy_ == wait_policy::spin || clock::now() < end);
+
+		return false;
+	}
+
+public:
+	event_loop() = default;
+	event_loop(const event_loop&) = delete;
+	event_loop& operator=(const event_loop&) = delete;
+
+	asio::io_service& service()
+	{
+		return io_service_;
+	}
+
+	void set_wait_policy(wait_policy policy, std::chrono::microseconds spin_time)
+	{
+		policy_ = policy;
+		spin_time_ = spin_time;
+	}
+
+	const wait_stats& get_wait_stats() const
+	{
+		return stats_;
+	}
+
+	template <class Predicate>
+	void run_until(Predicate done)
+	{
+		if (done())
+			return;
+
+		auto start = clock::now();
+
+		if (policy_ != wait_policy::block)
+		{
+			bool finished = poll_until(done, start + spin_time_, false);
+			auto now = clock::now();
+			stats_.spin += now - start;
+			start = now;
+
+			if (finished)
+			{
+				stats_.spin_waits++;
+				return;
+			}
+
+			finished = poll_until(done, start + spin_time_, true);
+			now = clock::now();
+			stats_.yield += now - start;
+			start = now;
+
+			if (finished)
+			{
+				stats_.yield_waits++;
+				return;
+			}
+		}
+
+		while (!done())
+		{
+			if (io_service_.stopped())
+				io_service_.restart();
+
+			if (io_service_.run_one() == 0)
+				throw std::runtime_error("event loop has nothing to wait for");
+		}
+
+		stats_.block += clock::now() - start;
+		stats_.block_waits++;
+	}
+};
+
+// Deadline of a tick, moved every tick without cancelling the timer wait: a
+// wait left from an earlier deadline fires early and re-arms itself for the
+// current one, so all waits share one handler_memory and don't allocate.
+class tick_timer
+{
+	using clock = std::chrono::steady_clock;
+
+	asio::steady_timer timer_;
+	handler_memory memory_;
+	clock::time_point deadline_{};
+	bool running_{ false };
+	bool waiting_{ false };
+	bool expired_{ false };
+
+	void arm()
+	{
+		waiting_ = true;
+		timer_.expires_at(deadline_);
+		timer_.async_wait(bind_memory(memory_, [this](const asio::error_code& ec)
+		{
+			waiting_ = false;
+
+			if (ec || !running_)
+				return;
+
+			if (clock::now() < deadline_)
+			{
+				arm();
+				return;
+			}
+
+			running_ = false;
+			expired_ = true;
+		}));
+	}
+
+public:
+	explicit tick_timer(event_loop& loop)
+		: timer_(loop.service())
+	{
+	}
+
+	tick_timer(const tick_timer&) = delete;
+	tick_timer& operator=(const tick_timer&) = delete;
+
+	void start(clock::duration timeout)
+	{
+		deadline_ = clock::now() + timeout;
+		running_ = true;
+		expired_ = false;
+
+		if (!waiting_)
+			arm();
+	}
+
+	void stop()
+	{
+		running_ = false;
+	}
+
+	bool expired() const
+	{
+		return expired_;
+	}
+};
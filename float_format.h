@@ -0,0 +1,241 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#if __has_include(<charconv>)
+#include <charconv>
+#endif
+
+#include <rapidjson/rapidjson.h>
+#include <rapidjson/internal/dtoa.h>
+
+#include "json_scan.h"
+#include "messages.h"
+
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+#define MULTI_ENV_HAS_FLOAT_CHARCONV 1
+#endif
+
+// Formatting of doubles for outgoing JSON. With digits == 0 a value is written
+// as the shortest text that reads back to the same double, otherwise it is
+// rounded to `digits` significant digits. Values are written straight into the
+// writer's output stream, a row at a time.
+//
+// Incoming rows of plain numbers are parsed in bulk by parse_task().
+
+static const std::size_t max_double_chars = 32;
+static const int max_float_digits = 17;
+
+inline char* format_double(char* p, double v, int digits)
+{
+	// JSON has no NaN or infinity
+	if (!std::isfinite(v))
+	{
+		std::memcpy(p, "null", 4);
+		return p + 4;
+	}
+
+	char* begin = p;
+
+#if defined(MULTI_ENV_HAS_FLOAT_CHARCONV)
+	if (digits == 0)
+		p = std::to_chars(p, p + max_double_chars, v).ptr;
+	else
+		p = std::to_chars(p, p + max_double_chars, v, std::chars_format::general, digits).ptr;
+#else
+	if (digits == 0)
+		return rapidjson::internal::dtoa(v, p);
+
+	p += std::snprintf(p, max_double_chars, "%.*g", digits, v);
+#endif
+
+	// integral values keep a fraction like rapidjson writes them, so readers still get doubles
+	if (std::find_if(begin, p, [](char c) { return c == '.' || c == 'e'; }) == p)
+	{
+		*p++ = '.';
+		*p++ = '0';
+	}
+
+	return p;
+}
+
+inline std::size_t max_task_chars(std::size_t n)
+{
+	return n * (max_double_chars + 1) + 2;
+}
+
+// Writes "[v0,v1,...]", at most max_task_chars(n) characters.
+inline char* format_task(char* p, const double* values, std::size_t n, int digits)
+{
+	*p++ = '[';
+	for (std::size_t i = 0; i < n; i++)
+	{
+		if (i != 0)
+			*p++ = ',';
+		p = format_double(p, values[i], digits);
+	}
+	*p++ = ']';
+
+	return p;
+}
+
+template <class Stream>
+inline void put_task(Stream& s, const double* values, std::size_t n, int digits)
+{
+	std::size_t reserved = max_task_chars(n);
+	char* begin = s.Push(reserved);
+	char* end = format_task(begin, values, n, digits);
+	s.Pop(reserved - static_cast<std::size_t>(end - begin));
+}
+
+// The writer only sees the opening bracket as a raw value, the rest of the
+// array is appended to its stream directly. Invalid rows are written as null
+// when empty_as_null is set, and as [] otherwise. Tasks is a task_batch or a
+// task_batch_view.
+template <class Writer, class Stream, class Tasks>
+inline void write_tasks(Writer& doc, Stream& s, const Tasks& tasks, int digits,
+	bool empty_as_null)
+{
+	doc.RawValue("[", 1, rapidjson::kArrayType);
+
+	for (std::size_t i = 0; i < tasks.rows(); i++)
+	{
+		if (i != 0)
+			s.Put(',');
+
+		if (!tasks.valid(i))
+		{
+			if (empty_as_null)
+				std::memcpy(s.Push(4), "null", 4);
+			else
+				std::memcpy(s.Push(2), "[]", 2);
+			continue;
+		}
+
+		put_task(s, tasks.row(i), tasks.width(), digits);
+	}
+
+	s.Put(']');
+}
+
+// Replaces rows with `count` rows of tasks as JSON text, a segment of a batch
+// that is serialized in pieces. Rows that tasks doesn't have or that are
+// invalid are null, and the others are cut or padded with zeros to `width`.
+template <class Tasks>
+inline void format_rows(json_rows& rows, const Tasks& tasks, std::size_t count, std::size_t width,
+	int digits)
+{
+	buffer_growth growth;
+	rows.clear();
+
+	for (std::size_t i = 0; i < count; i++)
+	{
+		if (i >= tasks.rows() || !tasks.valid(i))
+		{
+			rows.text.append(i != 0 ? ",null" : "null");
+			rows.ends.push_back(rows.text.size());
+			continue;
+		}
+
+		std::size_t at = rows.text.size();
+		rows.text.resize(at + max_task_chars(width) + 1);
+
+		char* begin = &rows.text[0];
+		char* p = begin + at;
+		if (i != 0)
+			*p++ = ',';
+
+		const double* values = tasks.row(i);
+		std::size_t n = std::min(width, tasks.width());
+
+		*p++ = '[';
+		for (std::size_t k = 0; k < width; k++)
+		{
+			if (k != 0)
+				*p++ = ',';
+			p = format_double(p, k < n ? values[k] : 0.0, digits);
+		}
+		*p++ = ']';
+
+		rows.text.resize(static_cast<std::size_t>(p - begin));
+		rows.ends.push_back(rows.text.size());
+	}
+}
+
+// Writes a flat array of values, e.g. restart scores.
+template <class Writer, class Stream>
+inline void write_values(Writer& doc, Stream& s, const std::vector<double>& values, int digits)
+{
+	doc.RawValue("", 0, rapidjson::kArrayType);
+	put_task(s, values.data(), values.size(), digits);
+}
+
+// Parses the numbers of a flat array, p points right after its '['. Every value
+// is passed to push(double), which returns false to give up. Returns the
+// position of the closing ']', or nullptr if the array holds anything but
+// numbers or push gave up; the caller drops the partial row then.
+template <class Push>
+inline const char* parse_task(const char* p, const char* end, Push push)
+{
+#if defined(MULTI_ENV_HAS_FLOAT_CHARCONV)
+	p = json_skip_ws(p, end);
+	if (p != end && *p == ']')
+		return p;
+
+	while (p != end)
+	{
+		// from_chars would also take "inf" and "nan", which aren't JSON
+		if (*p != '-' && (*p < '0' || *p > '9'))
+			return nullptr;
+
+		double v;
+		auto res = std::from_chars(p, end, v);
+		if (res.ec != std::errc())
+			return nullptr;
+
+		if (!push(v))
+			return nullptr;
+
+		p = json_skip_ws(res.ptr, end);
+		if (p == end)
+			return nullptr;
+
+		if (*p == ']')
+			return p;
+
+		if (*p != ',')
+			return nullptr;
+
+		p = json_skip_ws(p + 1, end);
+	}
+#else
+	(void)p;
+	(void)end;
+	(void)push;
+#endif
+
+	return nullptr;
+}
+
+// For SAX handlers, called from StartArray: the reader has just taken the '['
+// from stream. A row of plain numbers is parsed in one go and the stream is
+// moved to its ']', so the reader only reports EndArray. Returns false if the
+// row is left to the callbacks.
+template <class Stream, class Push>
+inline bool parse_stream_task(Stream* stream, const char* end, Push push)
+{
+	if (stream == nullptr)
+		return false;
+
+	const char* task_end = parse_task(stream->src_, end, push);
+	if (task_end == nullptr)
+		return false;
+
+	stream->src_ = task_end;
+	return true;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+// nul: every packet ends with '\0' (the original protocol).
+// length: every packet is preceded by its payload size as 4-byte little-endian
+// unsigned integer. Senders drop the trailing '\0' of the payload and
+// receivers append one after it, so packets can be parsed as C strings.
+enum class framing_mode
+{
+	nul = 0,
+	length
+};
+
+static const std::size_t frame_header_size = 4;
+
+// Frames announcing more are taken for a corrupt or desynced stream.
+static const std::size_t default_max_frame_size = std::size_t(256) << 20;
+
+inline framing_mode parse_framing(const std::string& name)
+{
+	if (name.empty() || name == "nul")
+		return framing_mode::nul;
+	if (name == "length")
+		return framing_mode::length;
+
+	throw std::invalid_argument("unknown framing '" + name + "'");
+}
+
+inline void write_frame_header(unsigned char* hdr, std::size_t sz)
+{
+	if (sz > UINT32_MAX)
+		throw std::runtime_error("packet is too large for length framing");
+
+	for (std::size_t i = 0; i < frame_header_size; i++)
+	{
+		hdr[i] = static_cast<unsigned char>(sz >> (8 * i));
+	}
+}
+
+inline std::size_t read_frame_header(const unsigned char* hdr)
+{
+	std::size_t sz = 0;
+	for (std::size_t i = 0; i < frame_header_size; i++)
+	{
+		sz |= static_cast<std::size_t>(hdr[i]) << (8 * i);
+	}
+	return sz;
+}
+
+// Reads a frame header, throws if it announces more than max_size bytes.
+inline std::size_t read_frame_header(const unsigned char* hdr, std::size_t max_size)
+{
+	std::size_t sz = read_frame_header(hdr);
+	if (sz > max_size)
+		throw std::runtime_error("framing error: frame of " + std::to_string(sz) +
+			" bytes exceeds the limit of " + std::to_string(max_size));
+	return sz;
+}
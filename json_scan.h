@@ -0,0 +1,138 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+
+// Lightweight scanning of packet JSON for the passthrough mode. Values are
+// located by their byte ranges and never converted, so forwarded numbers stay
+// byte-identical. The text is expected to be valid JSON.
+
+struct json_member
+{
+	const char* name;
+	const char* begin{ nullptr };
+	const char* end{ nullptr };
+};
+
+inline const char* json_skip_ws(const char* p, const char* end)
+{
+	while (p != end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+	{
+		p++;
+	}
+	return p;
+}
+
+// p points to the opening quote, returns the position after the closing one.
+inline const char* json_skip_string(const char* p, const char* end)
+{
+	for (p++; p != end; p++)
+	{
+		if (*p == '\\' && p + 1 != end)
+			p++;
+		else if (*p == '"')
+			return p + 1;
+	}
+	return end;
+}
+
+inline const char* json_skip_value(const char* p, const char* end)
+{
+	if (p == end)
+		return end;
+
+	if (*p == '"')
+		return json_skip_string(p, end);
+
+	if (*p == '[' || *p == '{')
+	{
+		size_t depth = 0;
+
+		while (p != end)
+		{
+			switch (*p)
+			{
+			case '"':
+				p = json_skip_string(p, end);
+				continue;
+			case '[':
+			case '{':
+				depth++;
+				break;
+			case ']':
+			case '}':
+				if (--depth == 0)
+					return p + 1;
+				break;
+			}
+			p++;
+		}
+		return end;
+	}
+
+	while (p != end && *p != ',' && *p != ']' && *p != '}' &&
+		*p != ' ' && *p != '\t' && *p != '\n' && *p != '\r')
+	{
+		p++;
+	}
+	return p;
+}
+
+// Records the value ranges of the named members found at any depth. Values of
+// the requested members are skipped as a whole.
+inline void json_scan_members(const char* p, const char* end, json_member* members, size_t n)
+{
+	while (p != end && *p != '\0')
+	{
+		if (*p != '"')
+		{
+			p++;
+			continue;
+		}
+
+		const char* name = p + 1;
+		p = json_skip_string(p, end);
+		size_t len = p - name - 1;
+
+		const char* colon = json_skip_ws(p, end);
+		if (colon == end || *colon != ':')
+			continue;
+
+		for (size_t i = 0; i < n; i++)
+		{
+			if (std::strlen(members[i].name) == len && std::strncmp(members[i].name, name, len) == 0)
+			{
+				members[i].begin = json_skip_ws(colon + 1, end);
+				members[i].end = json_skip_value(members[i].begin, end);
+				p = members[i].end;
+				break;
+			}
+		}
+	}
+}
+
+// Calls f(begin, end) for every element of the array starting at p.
+template <class F>
+inline void json_for_each_element(const char* p, const char* end, F f)
+{
+	if (p == end || *p != '[')
+		return;
+
+	p = json_skip_ws(p + 1, end);
+
+	while (p != end && *p != ']')
+	{
+		const char* elem_end = json_skip_value(p, end);
+		f(p, elem_end);
+
+		p = json_skip_ws(elem_end, end);
+		if (p != end && *p == ',')
+			p = json_skip_ws(p + 1, end);
+	}
+}
+
+inline bool json_equals(const char* begin, const char* end, const char* text)
+{
+	size_t len = std::strlen(text);
+	return static_cast<size_t>(end - begin) == len && std::strncmp(begin, text, len) == 0;
+}
@@ -2,40 +2,141 @@
 #include <memory>
 #include <vector>
 #include <algorithm>
+#include <thread>
 
 #include <CLI/App.hpp>
 #include <CLI/Validators.hpp>
 
 #include "tiny-process-library/process.hpp"
 
+#include "alloc_counter.h"
+#include "codec_pool.h"
+#include "event_loop.h"
+#include "float_format.h"
 #include "nlab.h"
 #include "remote_env.h"
+#include "pipe_stream.h"
+#include "plugin_env.h"
+#include "shm_stream.h"
 #include "tcp_stream.h"
+#include "unix_stream.h"
+#include "uri.h"
+#include "uring_stream.h"
+
+// What becomes of the packet of an env that missed the tick deadline, which
+// is taken in a later tick: defer forwards its rows to nlab then, drop
+// forwards null rows in their place.
+enum class late_policy
+{
+	defer,
+	drop
+};
+
+late_policy parse_late_policy(const std::string& name) {
+	if (name == "defer")
+		return late_policy::defer;
+	if (name == "drop")
+		return late_policy::drop;
+
+	throw std::invalid_argument("unknown late policy '" + name + "'");
+}
 
 class multi_env {
 	std::string envs_uri_;
 	std::string nlab_uri_;
 	bool use_existing_{ false };
+	bool needs_spawn_{ true };
+	bool single_port_{ false };
+	bool uring_checked_{ false };
+	bool passthrough_{ false };
+	int float_digits_{ 0 };
+	bool check_allocs_{ false };
+	int codec_threads_{ 0 };
+	bool async_restart_{ false };
+	std::chrono::milliseconds tick_deadline_{ 0 };
+	late_policy late_policy_{ late_policy::defer };
+	size_t late_slots_{ 0 };
+	size_t late_packets_{ 0 };
+	tick_allocations tick_allocs_;
 	int env_count_;
 	std::string command_;
 
+	event_loop loop_;
+	buffer_pool pool_;
+	tick_timer deadline_{ loop_ };
+	std::unique_ptr<worker_pool> workers_{nullptr};
+#if defined(MULTI_ENV_HAS_IO_URING)
+	std::unique_ptr<uring> ring_{nullptr};
+#endif
+
 	std::unique_ptr<nlab> lab_{nullptr};
-	std::vector<std::unique_ptr<remote_env>> envs_;
+	std::vector<std::unique_ptr<base_env>> envs_;
+	// tcp:// streams whose socket options are printed once connected
+	tcp_stream* lab_tcp_{ nullptr };
+	tcp_stream* env_tcp_{ nullptr };
 	std::vector<std::string> uris_;
 
+	std::unique_ptr<base_listener> listener_{nullptr};
+	std::vector<remote_env*> hello_envs_;
+
 	std::vector<std::unique_ptr<TinyProcessLib::Process>> sub_procs;
 
 	void spawn_envs();
+	std::unique_ptr<tcp_stream> make_tcp_stream(const connection_uri& uri, const std::string& host,
+		const std::string& port, const tcp_options& options);
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+	std::unique_ptr<unix_stream> make_unix_stream(const connection_uri& uri, const std::string& path);
+#endif
+	std::unique_ptr<remote_env> make_remote_env(std::unique_ptr<base_stream>&& stream);
+	void add_hello_env(std::unique_ptr<remote_env>&& env);
+	void assign_env_slots();
 
 public:
 
 	multi_env(std::string envs_uri, std::string nlab_uri,
-		int env_count, std::string command, bool use_existing = false)
+		int env_count, std::string command, bool use_existing = false, bool huge_pages = false,
+		bool single_port = false)
 		: envs_uri_(envs_uri), nlab_uri_(nlab_uri), env_count_(env_count),
-		command_(command), use_existing_(use_existing)
+		command_(command), use_existing_(use_existing), single_port_(single_port), pool_(huge_pages)
 	{
 	};
 
+	void set_wait_policy(wait_policy policy, std::chrono::microseconds spin_time)
+	{
+		loop_.set_wait_policy(policy, spin_time);
+	}
+
+	void set_passthrough(bool passthrough)
+	{
+		passthrough_ = passthrough;
+	}
+
+	void set_float_digits(int digits)
+	{
+		float_digits_ = digits;
+	}
+
+	void set_check_allocs(bool check)
+	{
+		check_allocs_ = check;
+	}
+
+	void set_codec_threads(int threads)
+	{
+		codec_threads_ = threads;
+	}
+
+	void set_async_restart(bool async_restart)
+	{
+		async_restart_ = async_restart;
+	}
+
+	void set_tick_deadline(std::chrono::milliseconds deadline, late_policy policy)
+	{
+		tick_deadline_ = deadline;
+		late_policy_ = policy;
+	}
+
 	void init_nlab();
 	void init_envs();
 	void connect_nlab();
@@ -55,23 +156,74 @@ void multi_env::init_nlab() {
 	if (lab_)
 		throw std::runtime_error("already initialized");
 
-	auto colon_ind = nlab_uri_.find("://");
-	if (colon_ind == std::string::npos)
-		throw std::invalid_argument("couldn't parse connection URI");
-
-	auto uri_net_part = nlab_uri_.substr(colon_ind + 3);
-	auto scheme = nlab_uri_.substr(0, colon_ind);
+	auto uri = connection_uri::parse(nlab_uri_);
 
-	if (scheme == "tcp") {
-		auto port_ind = uri_net_part.find(":");
+	if (uri.scheme == "tcp") {
+		auto port_ind = uri.address.find(":");
 		if (port_ind == std::string::npos)
 			throw std::invalid_argument("couldn't parse connection URI");
-		lab_ = std::make_unique<nlab>(std::make_unique<tcp_stream>(uri_net_part.substr(0, port_ind),
-			uri_net_part.substr(port_ind + 1), 3072000));
+
+		auto stream = make_tcp_stream(uri, uri.address.substr(0, port_ind),
+			uri.address.substr(port_ind + 1), tcp_options::parse(uri));
+		lab_tcp_ = stream.get();
+
+		lab_ = std::make_unique<nlab>(std::move(stream), pool_);
 	}
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+	else if (uri.scheme == "unix") {
+		lab_ = std::make_unique<nlab>(make_unix_stream(uri, uri.address), pool_);
+	}
+#endif
+#if defined(ASIO_HAS_POSIX_STREAM_DESCRIPTOR)
+	else if (uri.scheme == "shm") {
+		lab_ = std::make_unique<nlab>(std::make_unique<shm_stream>(loop_, uri.address,
+			shm_stream::default_ring_size), pool_);
+	}
+#endif
 	else throw std::invalid_argument("unknown connection URI scheme");
+
+	lab_->set_passthrough(passthrough_);
+	lab_->set_float_digits(float_digits_);
+	lab_->set_async_restart(async_restart_);
+}
+
+std::unique_ptr<tcp_stream> multi_env::make_tcp_stream(const connection_uri& uri,
+	const std::string& host, const std::string& port, const tcp_options& options) {
+	auto framing = parse_framing(uri.param("framing"));
+	std::unique_ptr<tcp_stream> stream;
+
+	if (parse_flag_param("io_uring", uri.param("io_uring"))) {
+		if (!uring_checked_) {
+			uring_checked_ = true;
+#if defined(MULTI_ENV_HAS_IO_URING)
+			if (uring::available())
+				ring_ = std::make_unique<uring>(loop_);
+			else
+#endif
+				std::cout << "io_uring isn't available, falling back to regular socket I/O\n";
+		}
+#if defined(MULTI_ENV_HAS_IO_URING)
+		if (ring_)
+			stream = std::make_unique<uring_stream>(loop_, pool_, *ring_, host, port, framing, options);
+#endif
+	}
+
+	if (!stream)
+		stream = std::make_unique<tcp_stream>(loop_, pool_, host, port, framing, options);
+
+	stream->set_max_frame_size(tcp_stream::max_frame_size(uri));
+	return stream;
 }
 
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+std::unique_ptr<unix_stream> multi_env::make_unix_stream(const connection_uri& uri,
+	const std::string& path) {
+	auto stream = std::make_unique<unix_stream>(loop_, pool_, path, parse_framing(uri.param("framing")));
+	stream->set_max_frame_size(unix_stream::max_frame_size(uri));
+	return stream;
+}
+#endif
+
 void multi_env::init_envs() {
 	if (!envs_.empty())
 		throw std::runtime_error("already initialized");
@@ -79,37 +231,169 @@ void multi_env::init_envs() {
 	if (env_count_ <= 0)
 		throw std::invalid_argument("env_count less that 0");
 
-	auto colon_ind = envs_uri_.find("://");
-	if (colon_ind == std::string::npos)
-		throw std::invalid_argument("couldn't parse connection URI");
+	auto uri = connection_uri::parse(envs_uri_);
+	auto framing = parse_framing(uri.param("framing"));
 
-	auto uri_net_part = envs_uri_.substr(colon_ind + 3);
-	auto scheme = envs_uri_.substr(0, colon_ind);
-
-	if (scheme == "tcp") {
-		auto port_ind = uri_net_part.find(":");
+	if (uri.scheme == "tcp") {
+		auto port_ind = uri.address.find(":");
 		if (port_ind == std::string::npos)
 			throw std::invalid_argument("couldn't parse connection URI");
 
-		int port = std::stoi(uri_net_part.substr(port_ind + 1));
-		std::string host = uri_net_part.substr(0, port_ind);
-		std::string proto_part = "tcp://";
+		int port = std::stoi(uri.address.substr(port_ind + 1));
+		std::string host = uri.address.substr(0, port_ind);
 
-		for (int i = 0; i < env_count_; i++) {
+		auto options = tcp_options::parse(uri);
+
+		if (single_port_) {
+			std::string port_string = std::to_string(port);
+			auto listener = std::make_unique<tcp_listener>(loop_, port_string);
+
+			for (int i = 0; i < env_count_; i++) {
+				auto stream = make_tcp_stream(uri, host, port_string, options);
+				stream->share_listener(*listener);
+				if (i == 0)
+					env_tcp_ = stream.get();
+				add_hello_env(make_remote_env(std::move(stream)));
+
+				uris_.emplace_back(uri.with_address(uri.address, "id=" + std::to_string(i)));
+			}
+
+			listener_ = std::move(listener);
+		}
+		else for (int i = 0; i < env_count_; i++) {
 			std::string port_string = std::to_string(port++);
-			envs_.emplace_back(std::make_unique<remote_env>(
-				std::make_unique<tcp_stream>(host, port_string, 3072000)));
+			auto stream = make_tcp_stream(uri, host, port_string, options);
+			if (i == 0)
+				env_tcp_ = stream.get();
+			envs_.emplace_back(make_remote_env(std::move(stream)));
+
+			uris_.emplace_back(uri.with_address(host + std::string(":") + port_string));
+		}
+
+	}
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+	else if (uri.scheme == "unix" && single_port_) {
+		auto listener = std::make_unique<unix_listener>(loop_, uri.address);
+
+		for (int i = 0; i < env_count_; i++) {
+			auto stream = make_unix_stream(uri, uri.address);
+			stream->share_listener(*listener);
+			add_hello_env(make_remote_env(std::move(stream)));
+
+			uris_.emplace_back(uri.with_address(uri.address, "id=" + std::to_string(i)));
+		}
+
+		listener_ = std::move(listener);
+	}
+	else if (uri.scheme == "unix") {
+		for (int i = 0; i < env_count_; i++) {
+			std::string path = uri.address + std::to_string(i);
+			envs_.emplace_back(make_remote_env(make_unix_stream(uri, path)));
+
+			uris_.emplace_back(uri.with_address(path));
+		}
+	}
+#endif
+	else if (uri.scheme == "pipe") {
+		if (use_existing_)
+			throw std::invalid_argument("pipe:// environments can't be existing ones");
+
+		for (int i = 0; i < env_count_; i++) {
+			std::string env_uri = uri.with_address(std::to_string(i));
+			envs_.emplace_back(make_remote_env(
+				std::make_unique<pipe_stream>(loop_, command_ + std::string(" --uri ") + env_uri,
+					framing)));
 
-			uris_.emplace_back(proto_part + host + std::string(":") + port_string);
+			uris_.emplace_back(env_uri);
 		}
 
+		needs_spawn_ = false;
+	}
+	else if (uri.scheme == "plugin") {
+		if (passthrough_)
+			throw std::invalid_argument("plugin:// environments don't support the passthrough mode");
+
+		if (codec_threads_ > 0)
+			throw std::invalid_argument("plugin:// environments don't support codec threads");
+
+		auto lib = std::make_shared<plugin_library>(uri.address);
+		workers_ = std::make_unique<worker_pool>(std::thread::hardware_concurrency());
+
+		for (int i = 0; i < env_count_; i++) {
+			envs_.emplace_back(std::make_unique<plugin_env>(lib, loop_, *workers_,
+				static_cast<unsigned>(i)));
+
+			uris_.emplace_back(envs_uri_ + std::string("#") + std::to_string(i));
+		}
+
+		needs_spawn_ = false;
+	}
+#if defined(ASIO_HAS_POSIX_STREAM_DESCRIPTOR)
+	else if (uri.scheme == "shm") {
+		auto ring_size = shm_stream::ring_size(uri);
+
+		for (int i = 0; i < env_count_; i++) {
+			std::string path = uri.address + std::to_string(i);
+			envs_.emplace_back(make_remote_env(
+				std::make_unique<shm_stream>(loop_, path, ring_size)));
+
+			uris_.emplace_back(uri.with_address(path));
+		}
 	}
+#endif
 	else throw std::invalid_argument("unknown connection URI scheme");
+
+	if (single_port_ && !listener_)
+		throw std::invalid_argument("single port mode needs a tcp:// or unix:// environments URI");
+}
+
+std::unique_ptr<remote_env> multi_env::make_remote_env(std::unique_ptr<base_stream>&& stream) {
+	auto env = std::make_unique<remote_env>(std::move(stream), pool_);
+	env->set_passthrough(passthrough_);
+	env->set_float_digits(float_digits_);
+	return env;
+}
+
+void multi_env::add_hello_env(std::unique_ptr<remote_env>&& env) {
+	env->expect_hello();
+	hello_envs_.push_back(env.get());
+	envs_.emplace_back(std::move(env));
+}
+
+void multi_env::assign_env_slots() {
+	std::vector<std::unique_ptr<base_env>> slots(envs_.size());
+	std::vector<size_t> anonymous;
+
+	for (size_t i = 0; i < envs_.size(); i++) {
+		int id = hello_envs_[i]->get_hello_id();
+
+		if (id < 0) {
+			anonymous.push_back(i);
+			continue;
+		}
+
+		if (static_cast<size_t>(id) >= slots.size() || slots[id])
+			throw std::runtime_error("invalid or duplicate env id " + std::to_string(id) + " in hello");
+
+		slots[id] = std::move(envs_[i]);
+	}
+
+	auto next = anonymous.begin();
+	for (auto& slot : slots) {
+		if (!slot)
+			slot = std::move(envs_[*next++]);
+	}
+
+	envs_.swap(slots);
+	hello_envs_.clear();
 }
 
 void multi_env::connect_nlab() {
 	if (lab_->connect())
 		throw "nlab connection failed";
+
+	if (lab_tcp_)
+		std::cout << "nlab socket options: " << lab_tcp_->describe_options() << "\n";
 }
 
 void multi_env::connect_envs() {
@@ -122,13 +406,16 @@ void multi_env::connect_envs() {
 
 	std::cout << create_string << "\n";
 
+	if (listener_)
+		listener_->create();
+
 	for (auto& i : envs_) {
 		i->init();
 	}
 
 	std::cout << "pipes created\n";
 
-	if (!use_existing_)
+	if (!use_existing_ && needs_spawn_)
 		spawn_envs();
 
 	std::cout << "waiting for connection\n";
@@ -138,8 +425,16 @@ void multi_env::connect_envs() {
 		i->wait();
 	}
 
+	if (listener_) {
+		assign_env_slots();
+		listener_->close();
+	}
+
 	std::cout << "all subs connected\n";
 
+	if (env_tcp_)
+		std::cout << "environments socket options: " << env_tcp_->describe_options() << "\n";
+
 	e_start_info esi_n;
 	esi_n.count = 0;
 	esi_n.mode = send_modes::specified;
@@ -210,6 +505,33 @@ void multi_env::cleanup() {
 		process->close_stdin();
 		process->get_exit_status();
 	}
+
+	std::cout << "buffer pool peak: " << pool_.peak_in_use() << " bytes in use, "
+		<< pool_.peak_allocated() << " bytes allocated\n";
+
+	auto& ws = loop_.get_wait_stats();
+	auto ms = [](std::chrono::steady_clock::duration d) {
+		return std::chrono::duration<double, std::milli>(d).count();
+	};
+
+	std::cout << "waiting: spin " << ms(ws.spin) << " ms (" << ws.spin_waits << " waits), yield "
+		<< ms(ws.yield) << " ms (" << ws.yield_waits << " waits), block "
+		<< ms(ws.block) << " ms (" << ws.block_waits << " waits)\n";
+
+	if (tick_deadline_.count() > 0) {
+		std::cout << "tick deadline: " << late_slots_ << " null slots sent for late environments, "
+			<< late_packets_ << " late packets taken\n";
+	}
+
+	if (check_allocs_) {
+		std::cout << "allocations: " << tick_allocs_.allocations() << " in "
+			<< tick_allocs_.allocating_ticks() << " of " << tick_allocs_.ticks()
+			<< " ticks after warm-up, " << tick_allocs_.growing_ticks()
+			<< " more grew buffers\n";
+
+		if (tick_allocs_.allocating_ticks() != 0)
+			throw std::runtime_error("ticks after warm-up allocated memory");
+	}
 }
 
 void multi_env::work() {
@@ -217,67 +539,338 @@ void multi_env::work() {
 
 	bool all_go = false;
 
-	n_send_info nsi_e;
-	nsi_e.head = verification_header::ok;
+	e_send_info esi_n;
+	n_send_info nsi;
+	e_restart_info eri_n;
+	size_t incount = lab_->get_state().incount;
+	size_t outcount = lab_->get_state().outcount;
+
+	// packets are read into per-environment storage that is reused every tick
+	std::vector<e_send_info> env_sends(envs_.size());
+	std::vector<n_send_view> env_views(envs_.size());
+	std::vector<size_t> offsets(envs_.size());
+	std::vector<size_t> pending;
+	std::vector<size_t> readable;
+	pending.reserve(envs_.size());
+	readable.reserve(envs_.size());
+
+	// With async restarts an env that finishes its episode is reseeded by nlab
+	// right away instead of idling until all envs have finished theirs.
+	bool async_restart = lab_->is_async_restart();
+	std::vector<size_t> restarting;
+	restarting.reserve(envs_.size());
+
+	if (async_restart_ && !async_restart && lab_->offers_binary())
+		std::cout << "async restarts aren't offered with the binary encoding, environments restart together\n";
+	else if (async_restart_ && !async_restart)
+		std::cout << "nlab doesn't support async restarts, environments restart together\n";
+
+	// for a JSON nlab every env's rows are serialized into a segment of their
+	// own, and the batch is sent straight from the segments
+	bool segmented = !lab_->is_binary();
+	std::vector<json_rows> env_rows(envs_.size());
+	std::vector<const json_rows*> segments(envs_.size());
+
+	auto format_segment = [&](size_t i) {
+		static const char null_row[] = "null";
+
+		auto& esi = env_sends[i];
+		size_t count = envs_[i]->get_state().count;
+
+		if (!passthrough_) {
+			format_rows(env_rows[i], esi.data, count, incount, float_digits_);
+			segments[i] = &env_rows[i];
+		}
+		else if (esi.raw.count() == count) {
+			segments[i] = &esi.raw;
+		}
+		else {
+			auto& rows = env_rows[i];
+			size_t valid = std::min(esi.raw.count(), count);
+
+			rows.assign(esi.raw, 0, valid);
+			for (size_t k = valid; k < count; k++)
+				rows.append(null_row, null_row + 4);
+
+			segments[i] = &rows;
+		}
+	};
+
+	// An env that misses the tick deadline is a null slot for nlab and isn't
+	// answered; its packet is taken in a later tick. waiting: the env's packet
+	// for this tick hasn't been taken yet; late: the env owes the packet of a
+	// missed tick; stale: the number of its next packets that answer requests
+	// from before a restart and are skipped.
+	std::vector<char> armed(envs_.size());
+	std::vector<char> waiting(envs_.size());
+	std::vector<char> late(envs_.size());
+	std::vector<size_t> stale(envs_.size());
+
+	auto after_decode = [&](size_t i) {
+		if (late[i] && late_policy_ == late_policy::drop) {
+			env_sends[i].data.clear();
+			env_sends[i].raw.clear();
+		}
+
+		if (segmented)
+			format_segment(i);
+	};
+
+	// with codec threads the loop thread only receives, sends and assembles;
+	// the envs' packets are parsed and serialized on the pool
+	std::vector<remote_env*> codec_envs;
+	std::unique_ptr<codec_pool> codec;
+
+	if (codec_threads_ > 0) {
+		for (auto& env : envs_) {
+			codec_envs.push_back(dynamic_cast<remote_env*>(env.get()));
+			if (!codec_envs.back())
+				throw std::invalid_argument("codec threads need remote environments");
+		}
+
+		codec = std::make_unique<codec_pool>(loop_, codec_threads_, envs_.size(),
+			[&](const codec_job& job) {
+				if (job.stage == codec_stage::encode) {
+					codec_envs[job.index]->encode(env_views[job.index]);
+					return;
+				}
+
+				codec_envs[job.index]->decode(env_sends[job.index]);
+				after_decode(job.index);
+			});
+	}
 
 	while (true) {
-		e_send_info esi_n;
+		if (check_allocs_)
+			tick_allocs_.next(all_go);
+
 		esi_n.head = verification_header::ok;
 
-		esi_n.data.reserve(lab_->get_state().count);
+		size_t total = 0;
+		pending.clear();
 
-		for (auto i = 0; i < envs_.size(); i++) {
+		for (size_t i = 0; i < envs_.size(); i++) {
 			auto& env = envs_[i];
 
-			if (env->get_header() != verification_header::ok && !all_go) {
-				esi_n.data.insert(esi_n.data.end(), env->get_state().count, env_task{ });
+			offsets[i] = total;
+			total += env->get_state().count;
+			env_sends[i].raw.clear();
+			waiting[i] = 0;
+
+			// a late env takes part until the packet it owes has been taken,
+			// whatever header it sent last
+			bool active = env->get_header() == verification_header::ok || all_go ||
+				(async_restart && env->get_header() == verification_header::restart) || late[i];
+
+			if (!active) {
+				env_sends[i].data.clear();
+				if (segmented)
+					format_segment(i);
+				continue;
+			}
+
+			pending.push_back(i);
+			waiting[i] = 1;
+		}
+
+		if (!segmented)
+			esi_n.data.reset(total, incount);
+
+		// late envs are still armed from the tick they missed
+		for (auto i : pending) {
+			if (armed[i])
 				continue;
+
+			armed[i] = 1;
+			envs_[i]->on_ready([&readable, i]() { readable.push_back(i); });
+		}
+
+		size_t remaining = std::count(waiting.begin(), waiting.end(), 1);
+		size_t failed = envs_.size();
+
+		if (tick_deadline_.count() > 0)
+			deadline_.start(tick_deadline_);
+
+		auto gathered = [&](size_t i) {
+			if (stale[i] != 0) {
+				stale[i]--;
+				armed[i] = 1;
+				envs_[i]->on_ready([&readable, i]() { readable.push_back(i); });
+				return;
 			}
 
-			e_send_info esi = env->get();
+			remaining--;
+			waiting[i] = 0;
 
-			if (esi.head == verification_header::restart) {
-				esi_n.data.insert(esi_n.data.end(), env->get_state().count, env_task{ });
-			} else if (esi.head != verification_header::ok) {
-				std::cout << "got " << static_cast<int>(esi.head) << " header from "
-					<< uris_[i] << ". stopping other environments and nlab\n";
+			if (late[i]) {
+				late[i] = 0;
+				late_packets_++;
+			}
 
-				for (auto& e : envs_) {
-					if (e->get_header() == verification_header::ok ||
-						e->get_header() == verification_header::restart) {
-						e->stop();
-					}
-					e->terminate();
-				}
+			auto& esi = env_sends[i];
 
-				lab_->stop();
-				std::cout << "stopped\n";
+			if (esi.head != verification_header::ok &&
+				esi.head != verification_header::restart) {
+				if (failed == envs_.size())
+					failed = i;
 				return;
 			}
 
-			for (auto& task : esi.data) {
-				esi_n.data.emplace_back();
-				esi_n.data.back().swap(task);
+			if (segmented)
+				return;
+
+			size_t count = std::min(esi.data.rows(), envs_[i]->get_state().count);
+			esi_n.data.copy_rows(offsets[i], esi.data, 0, count);
+		};
+
+		auto accepting = [&]() {
+			return remaining > 0 && failed == envs_.size() && !deadline_.expired();
+		};
+
+		auto parsing = [&]() {
+			return codec && codec->in_flight() > 0;
+		};
+
+		// after a failure or the deadline, packets still being parsed are
+		// waited for, so that no codec thread uses an env the tick is done with
+		while (accepting() || parsing()) {
+			loop_.run_until([&]() {
+				if (codec && codec->has_finished())
+					return true;
+
+				return accepting() ? !readable.empty() : !parsing();
+			});
+
+			if (!accepting())
+				pending.clear();
+			else {
+				pending.swap(readable);
+				readable.clear();
+			}
+
+			for (auto i : pending) {
+				auto& env = envs_[i];
+				armed[i] = 0;
+
+				// its packet is taken once the env is waited for again
+				if (!waiting[i])
+					continue;
+
+				if (!env->ready()) {
+					armed[i] = 1;
+					env->on_ready([&readable, i]() { readable.push_back(i); });
+					continue;
+				}
+
+				if (codec) {
+					codec->push(i, codec_stage::decode);
+					continue;
+				}
+
+				env->get(env_sends[i]);
+				after_decode(i);
+				gathered(i);
+			}
+
+			codec_job job;
+			while (codec && codec->pop(job)) {
+				if (job.error)
+					std::rethrow_exception(job.error);
+
+				gathered(job.index);
 			}
 		}
 
-		all_go = std::all_of(envs_.begin(), envs_.end(), 
-			[](auto& env) { return env->get_header() == verification_header::restart; });
+		deadline_.stop();
+
+		if (failed != envs_.size()) {
+			std::cout << "got " << static_cast<int>(env_sends[failed].head) << " header from "
+				<< uris_[failed] << ". stopping other environments and nlab\n";
+
+			for (auto& e : envs_) {
+				if (e->get_header() == verification_header::ok ||
+					e->get_header() == verification_header::restart) {
+					e->stop();
+				}
+				e->terminate();
+			}
+
+			lab_->stop();
+			std::cout << "stopped\n";
+			return;
+		}
+
+		if (remaining > 0) {
+			for (size_t i = 0; i < envs_.size(); i++) {
+				if (!waiting[i])
+					continue;
+
+				late[i] = 1;
+				late_slots_++;
+
+				env_sends[i].data.clear();
+				env_sends[i].raw.clear();
+				if (segmented)
+					format_segment(i);
+			}
+		}
+
+		all_go = !async_restart;
+		for (size_t i = 0; i < envs_.size() && all_go; i++)
+			all_go = !late[i] && envs_[i]->get_header() == verification_header::restart;
+
+		// their slots are null in the batch, and the scores go ahead of it
+		restarting.clear();
+		for (size_t i = 0; async_restart && i < envs_.size(); i++) {
+			if (late[i] || envs_[i]->get_header() != verification_header::restart)
+				continue;
+
+			n_restart_info nri_e;
+			nri_e.first = offsets[i];
+			nri_e.count = envs_[i]->get_state().count;
+			lab_->restart_env(nri_e, envs_[i]->get_restart_info());
+
+			restarting.push_back(i);
+		}
 
 		if (all_go) {
-			e_restart_info eri_n;
-			eri_n.result.reserve(lab_->get_state().count);
+			eri_n.result.clear();
 			for (auto& env : envs_) {
-				auto lrinfo = env->get_restart_info();
+				auto& lrinfo = env->get_restart_info();
 				eri_n.result.insert(eri_n.result.end(), lrinfo.result.begin(), lrinfo.result.end());
 			}
 
 			lab_->restart(eri_n);
+		} else if (segmented) {
+			lab_->set_rows(segments);
 		} else {
 			lab_->set(esi_n);
 		}
 
-		n_send_info nsi = lab_->get();
+		// nlab answers the env restarts in order, before the batch
+		bool reseeded = true;
+
+		for (auto i : restarting) {
+			lab_->get(nsi);
+
+			if (nsi.head == verification_header::ok)
+				throw std::runtime_error("nlab didn't answer the restart of " + uris_[i]);
+
+			if (nsi.head != verification_header::restart) {
+				reseeded = false;
+				break;
+			}
+
+			n_restart_info nri_e = lab_->get_restart_info();
+			if (nri_e.first != offsets[i])
+				throw std::runtime_error("nlab answered the restart of " + uris_[i] + " for another slot");
+
+			nri_e.count = envs_[i]->get_state().count;
+			envs_[i]->restart(nri_e);
+		}
+
+		if (reseeded)
+			lab_->get(nsi);
 
 		if (nsi.head == verification_header::restart) {
 			for (auto& env : envs_)
@@ -287,6 +880,15 @@ void multi_env::work() {
 				nri_e.round_seed = lab_->get_state().round_seed;
 				env->restart(nri_e);
 			}
+
+			for (size_t i = 0; i < envs_.size(); i++) {
+				stale[i] += late[i];
+				late[i] = 0;
+			}
+
+			// the envs reseeded this tick answer their own restart first
+			for (auto i : restarting)
+				stale[i]++;
 			continue;
 		} else if (nsi.head != verification_header::ok) {
 			std::cout << "got " << static_cast<int>(nsi.head)
@@ -300,26 +902,45 @@ void multi_env::work() {
 			return;
 		}
 
-		auto nsi_current = nsi.data.begin();
-		for (auto& env : envs_)
+		if ((passthrough_ ? nsi.raw.count() : nsi.data.rows()) < total)
+			throw std::runtime_error("nlab sent fewer data rows than the environments have");
+
+		if (!passthrough_ && total != 0 && nsi.data.width() != outcount)
+			throw std::runtime_error("nlab sent data rows that don't match outcount");
+
+		for (size_t i = 0; i < envs_.size(); i++)
 		{
-			size_t count = env->get_state().count;
-			if (env->get_header() != verification_header::ok && !all_go) {
-				nsi_current += count;
+			auto& env = envs_[i];
+			if ((env->get_header() != verification_header::ok && !all_go) || late[i])
 				continue;
-			}
 
-			nsi_e.data.resize(count);
+			// actions are written straight from nlab's batch
+			auto& view = env_views[i];
+			view.head = verification_header::ok;
 
-			for (size_t i = 0; i < count; ++i)
-			{
-				nsi_e.data[i].swap(*(nsi_current+i));
-			}
+			if (passthrough_)
+				view.raw = json_rows_view(nsi.raw, offsets[i], env->get_state().count);
+			else
+				view.data = task_batch_view(nsi.data, offsets[i], env->get_state().count);
 
-			nsi_current += count;
-			env->set(nsi_e);
+			if (codec)
+				codec->push(i, codec_stage::encode);
+			else
+				env->set(view);
 		}
 
+		// each packet is sent as soon as its env's serialization is done
+		while (codec && codec->in_flight() > 0) {
+			loop_.run_until([&codec]() { return codec->has_finished(); });
+
+			codec_job job;
+			while (codec->pop(job)) {
+				if (job.error)
+					std::rethrow_exception(job.error);
+
+				codec_envs[job.index]->send_encoded();
+			}
+		}
 	}
 }
 
@@ -330,18 +951,66 @@ int main(int argc, char** argv) {
 	std::string nlab_uri = "tcp://127.0.0.1:5005";
 
 	bool existing;
+	bool huge_pages;
+	bool single_port;
+	bool passthrough;
+	std::string policy = "block";
+	int spin_us = 50;
+	int float_digits = 0;
+	bool check_allocs;
+	bool async_restart;
+	int codec_threads = 0;
+	int tick_deadline_ms = 0;
+	std::string late = "defer";
 	int count;
 	std::string command;
 
 	app.add_option("-I,--envs-uri",	envs_uri,
-		"environments URI in format 'tcp://hostname:port'", true);
+		"environments URI in format 'tcp://hostname:port', 'unix:///path/prefix', 'shm:///path/prefix', 'pipe://' or 'plugin:///path/libenv.so'", true);
 
 	app.add_option("-O,--nlab-uri",	nlab_uri,
-		"nlab URI in format 'tcp://hostname:port'", true);
+		"nlab URI in format 'tcp://hostname:port', 'unix:///path' or 'shm:///path'", true);
 
 	app.add_flag("-e,--existing", existing,
 		"do not spawn environments, just connect to them");
 
+	app.add_flag("--huge-pages", huge_pages,
+		"back large receive and serialization buffers with huge pages");
+
+	app.add_flag("--single-port", single_port,
+		"accept all tcp:// or unix:// environments on one listener; envs identify themselves with a hello packet");
+
+	app.add_flag("--passthrough", passthrough,
+		"forward data rows as JSON text without parsing numbers; not available for plugin:// environments");
+
+	app.add_option("--float-digits", float_digits,
+		"significant digits of the numbers written to JSON packets, 0 for the shortest text that reads back exactly", true)
+		->check(CLI::Range(0, max_float_digits));
+
+	app.add_flag("--check-allocs", check_allocs,
+		"count heap allocations of ticks after warm-up, and fail if there are any");
+
+	app.add_option("--codec-threads", codec_threads,
+		"threads that parse and serialize the environments' packets while the main thread does the I/O, 0 to do all on the main thread", true)
+		->check(CLI::Range(0, 256));
+
+	app.add_flag("--async-restart", async_restart,
+		"restart every environment as soon as its episode ends, if nlab supports it, instead of when all have ended");
+
+	app.add_option("--tick-deadline-ms", tick_deadline_ms,
+		"milliseconds to wait for the environments each tick; late ones are sent to nlab as null slots, 0 to always wait", true)
+		->check(CLI::Range(0, 3600000));
+
+	app.add_option("--late-policy", late,
+		"what to do with the packet of an environment that missed the deadline when it arrives: 'defer' (forward it the next tick) or 'drop'", true);
+
+	app.add_option("--wait-policy", policy,
+		"how to wait for packets: 'block', 'hybrid' (spin, then yield, then block) or 'spin'", true);
+
+	app.add_option("--spin-us", spin_us,
+		"microseconds to spin and then to yield before blocking with the hybrid wait policy", true)
+		->check(CLI::Range(0, 1000000));
+
 	app.add_option("count", count, "count of environments to start")
 		->check(CLI::Range(0, 1024))
 		->required(true);
@@ -351,9 +1020,16 @@ int main(int argc, char** argv) {
 
 	CLI11_PARSE(app, argc, argv);
 
-	multi_env menv{ envs_uri, nlab_uri, count, command, existing };
+	multi_env menv{ envs_uri, nlab_uri, count, command, existing, huge_pages, single_port };
 
 	try	{
+		menv.set_wait_policy(parse_wait_policy(policy), std::chrono::microseconds(spin_us));
+		menv.set_passthrough(passthrough);
+		menv.set_float_digits(float_digits);
+		menv.set_check_allocs(check_allocs);
+		menv.set_codec_threads(codec_threads);
+		menv.set_async_restart(async_restart);
+		menv.set_tick_deadline(std::chrono::milliseconds(tick_deadline_ms), parse_late_policy(late));
 		menv.init_nlab();
 		menv.init_envs();
 
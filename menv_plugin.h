@@ -0,0 +1,65 @@
+#pragma once
+
+/*
+ * C ABI for in-process environments loaded with `-I plugin:///path/libenv.so`.
+ *
+ * The library exports menv_get_plugin(). Every environment instance is driven
+ * by one worker thread at a time, but different instances may run
+ * concurrently, so instances must not share unsynchronized state.
+ *
+ * Round flow: start() begins a round, then observe() is called to fetch the
+ * inputs of all agents. Every following tick calls step() with the outputs
+ * chosen by nlab and then observe() again. observe() returns one of the
+ * MENV_* headers; with MENV_RESTART it fills `scores` (count values) instead
+ * of `inputs`, and the next call is start() for a new round.
+ */
+
+#include <stddef.h>
+
+#if defined(_WIN32)
+#define MENV_PLUGIN_EXPORT __declspec(dllexport)
+#else
+#define MENV_PLUGIN_EXPORT __attribute__((visibility("default")))
+#endif
+
+#define MENV_PLUGIN_ABI_VERSION 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum
+{
+	MENV_OK = 0,
+	MENV_RESTART = 1,
+	MENV_STOP = 2,
+	MENV_FAIL = 3
+};
+
+typedef struct menv_start_info
+{
+	int mode;
+	size_t count;
+	size_t incount;
+	size_t outcount;
+} menv_start_info;
+
+typedef struct menv_plugin
+{
+	unsigned abi_version;
+	void* (*create)(unsigned index);
+	int (*get_start_info)(void* env, menv_start_info* info);
+	int (*start)(void* env, size_t count, size_t round_seed);
+	int (*observe)(void* env, double* inputs, double* scores);
+	int (*step)(void* env, const double* outputs);
+	void (*stop)(void* env);
+	void (*destroy)(void* env);
+} menv_plugin;
+
+typedef const menv_plugin* (*menv_get_plugin_fn)(void);
+
+MENV_PLUGIN_EXPORT const menv_plugin* menv_get_plugin(void);
+
+#ifdef __cplusplus
+}
+#endif
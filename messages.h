@@ -1,8 +1,11 @@
 #pragma once
 
+#include <algorithm>
+#include <cstddef>
+#include <string>
 #include <vector>
 
-using env_task = std::vector< double >;
+#include "alloc_counter.h"
 
 enum class verification_header
 {
@@ -32,22 +35,313 @@ struct n_start_info
 	size_t round_seed{ 0 };
 };
 
+// Data rows kept as JSON text by the passthrough mode: `count` row values
+// ("[...]" or "null") separated by commas, ends[i] is the end offset of row i.
+struct json_rows
+{
+	std::string text;
+	std::vector<size_t> ends;
+
+	size_t count() const
+	{
+		return ends.size();
+	}
+
+	void clear()
+	{
+		text.clear();
+		ends.clear();
+	}
+
+	void append(const char* begin, const char* end)
+	{
+		buffer_growth growth;
+		if (!ends.empty())
+			text.push_back(',');
+		text.append(begin, end);
+		ends.push_back(text.size());
+	}
+
+	// Appends all rows of a.
+	void append(const json_rows& a)
+	{
+		if (a.ends.empty())
+			return;
+
+		buffer_growth growth;
+		size_t offset = text.size() + (ends.empty() ? 0 : 1);
+		if (!ends.empty())
+			text.push_back(',');
+		text.append(a.text);
+
+		for (auto end : a.ends)
+		{
+			ends.push_back(offset + end);
+		}
+	}
+
+	// Replaces the contents with n rows of a, starting at row first.
+	void assign(const json_rows& a, size_t first, size_t n)
+	{
+		clear();
+		if (n == 0)
+			return;
+
+		buffer_growth growth;
+		size_t begin = a.row_begin(first);
+		text.assign(a.text, begin, a.ends[first + n - 1] - begin);
+
+		for (size_t i = first; i < first + n; i++)
+		{
+			ends.push_back(a.ends[i] - begin);
+		}
+	}
+
+	size_t row_begin(size_t i) const
+	{
+		return i == 0 ? 0 : ends[i - 1] + 1;
+	}
+
+	size_t row_size(size_t i) const
+	{
+		return ends[i] - row_begin(i);
+	}
+};
+
+// Row-major matrix with one row of `width` values per agent, kept in a single
+// buffer whose capacity survives reset(). Rows without data, e.g. null rows or
+// rows of inactive environments, are zero-filled and marked invalid.
+class task_batch
+{
+	std::vector<double> values_;
+	std::vector<unsigned char> valid_;
+	size_t rows_{ 0 };
+	size_t width_{ 0 };
+
+public:
+	// Sets the shape, all rows become invalid and zero.
+	void reset(size_t rows, size_t width)
+	{
+		buffer_growth growth;
+		rows_ = rows;
+		width_ = width;
+		values_.assign(rows * width, 0.0);
+		valid_.assign(rows, 0);
+	}
+
+	void reserve(size_t rows)
+	{
+		buffer_growth growth;
+		values_.reserve(rows * width_);
+		valid_.reserve(rows);
+	}
+
+	void clear()
+	{
+		reset(0, width_);
+	}
+
+	// Appends an invalid zero row and returns its index.
+	size_t append_row()
+	{
+		buffer_growth growth;
+		values_.resize(values_.size() + width_, 0.0);
+		valid_.push_back(0);
+		return rows_++;
+	}
+
+	size_t rows() const
+	{
+		return rows_;
+	}
+
+	size_t width() const
+	{
+		return width_;
+	}
+
+	bool empty() const
+	{
+		return rows_ == 0;
+	}
+
+	double* row(size_t i)
+	{
+		return values_.data() + i * width_;
+	}
+
+	const double* row(size_t i) const
+	{
+		return values_.data() + i * width_;
+	}
+
+	bool valid(size_t i) const
+	{
+		return valid_[i] != 0;
+	}
+
+	void set_valid(size_t i, bool valid = true)
+	{
+		valid_[i] = valid ? 1 : 0;
+	}
+
+	void set_all_valid()
+	{
+		valid_.assign(rows_, 1);
+	}
+
+	double* data()
+	{
+		return values_.data();
+	}
+
+	const double* data() const
+	{
+		return values_.data();
+	}
+
+	const unsigned char* mask() const
+	{
+		return valid_.data();
+	}
+
+	// Copies n rows of a, starting at row first, to the rows starting at row at.
+	// Rows are cut or zero-padded when the widths differ.
+	void copy_rows(size_t at, const task_batch& a, size_t first, size_t n)
+	{
+		if (a.width_ == width_)
+		{
+			std::copy_n(a.row(first), n * width_, row(at));
+			std::copy_n(a.valid_.begin() + first, n, valid_.begin() + at);
+			return;
+		}
+
+		size_t width = std::min(a.width_, width_);
+		for (size_t i = 0; i < n; i++)
+		{
+			std::copy_n(a.row(first + i), width, row(at + i));
+			std::fill(row(at + i) + width, row(at + i) + width_, 0.0);
+			valid_[at + i] = a.valid_[first + i];
+		}
+	}
+
+	void swap(task_batch& a)
+	{
+		values_.swap(a.values_);
+		valid_.swap(a.valid_);
+		std::swap(rows_, a.rows_);
+		std::swap(width_, a.width_);
+	}
+};
+
+// Rows [first, first + rows) of a task_batch, without owning them.
+class task_batch_view
+{
+	const task_batch* batch_{ nullptr };
+	size_t first_{ 0 };
+	size_t rows_{ 0 };
+
+public:
+	task_batch_view() = default;
+
+	task_batch_view(const task_batch& batch, size_t first, size_t rows)
+		: batch_(&batch), first_(first), rows_(rows)
+	{
+	}
+
+	size_t rows() const
+	{
+		return rows_;
+	}
+
+	size_t width() const
+	{
+		return batch_ ? batch_->width() : 0;
+	}
+
+	bool empty() const
+	{
+		return rows_ == 0;
+	}
+
+	const double* row(size_t i) const
+	{
+		return batch_->row(first_ + i);
+	}
+
+	bool valid(size_t i) const
+	{
+		return batch_->valid(first_ + i);
+	}
+
+	// The rows are contiguous, data() points at the first one.
+	const double* data() const
+	{
+		return batch_ ? batch_->row(first_) : nullptr;
+	}
+};
+
+// Rows [first, first + count) of json_rows, without owning them.
+class json_rows_view
+{
+	const json_rows* rows_{ nullptr };
+	size_t first_{ 0 };
+	size_t count_{ 0 };
+
+public:
+	json_rows_view() = default;
+
+	json_rows_view(const json_rows& rows, size_t first, size_t count)
+		: rows_(&rows), first_(first), count_(count)
+	{
+	}
+
+	size_t count() const
+	{
+		return count_;
+	}
+
+	const char* row_data(size_t i) const
+	{
+		return rows_->text.data() + rows_->row_begin(first_ + i);
+	}
+
+	size_t row_size(size_t i) const
+	{
+		return rows_->row_size(first_ + i);
+	}
+};
+
 struct n_send_info
 {
 	verification_header head{ verification_header::fail };
-	std::vector< env_task > data;
+	task_batch data;
+	json_rows raw;
+};
+
+// Actions for one environment, a slice of the batch nlab answered with.
+struct n_send_view
+{
+	verification_header head{ verification_header::fail };
+	task_batch_view data;
+	json_rows_view raw;
 };
 
 struct e_send_info
 {
 	verification_header head{ verification_header::fail };
-	std::vector< env_task > data;
+	task_batch data;
+	json_rows raw;
 };
 
 struct n_restart_info
 {
+	static constexpr size_t all_envs = static_cast<size_t>(-1);
+
 	size_t count{ 0 };
 	size_t round_seed{ 0 };
+	// Slot of the first row of the one env restarted, or all_envs.
+	size_t first{ all_envs };
 };
 
 struct e_restart_info
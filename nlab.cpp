@@ -1,15 +1,288 @@
 #include "nlab.h"
+#include "binary_packet.h"
+#include "float_format.h"
+#include "json_scan.h"
 
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
 #include <rapidjson/document.h>
+#include <rapidjson/reader.h>
 #include <rapidjson/writer.h>
 
 using namespace rapidjson;
 
-int nlab::connect()
+struct n_send_info_parser : public BaseReaderHandler<UTF8<>, n_send_info_parser>
 {
-	dom_buffer_.resize(dom_default_sz_);
-	stack_buffer_.resize(stack_default_sz_);
+	bool StartObject() {
+		switch (state_)
+		{
+		case kExpectMainObjectStart:
+			state_ = kExpectMainNameOrEnd;
+			return true;
+		case kExpectPacketObjectStart:
+			state_ = kExpectPacketNameOrEnd;
+			return true;
+		case kSkipValue:
+			skip_depth_++;
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	bool EndObject([[maybe_unused]] SizeType memberCount) {
+		switch (state_)
+		{
+		case kExpectMainNameOrEnd:
+			if (!got_type_ || !got_packet_ || !got_head_ ||
+				(result->head == verification_header::ok && !got_data_))
+			{
+				throw std::runtime_error("nlab::get failed. Required JSON fields are missing");
+			}
+			return true;
+		case kExpectPacketNameOrEnd:
+			state_ = kExpectMainNameOrEnd;
+			return true;
+		case kSkipValue:
+			return end_skipped();
+		default:
+			return false;
+		}
+	}
+
+	bool Key(const Ch* str, SizeType len, [[maybe_unused]] bool copy) {
+		switch (state_)
+		{
+		case kExpectMainNameOrEnd:
+			if (strncmp(str, "type", len) == 0) {
+				got_type_ = true;
+				state_ = kExpectType;
+			}
+			else if (strncmp(str, "n_send_info", len) == 0) {
+				got_packet_ = true;
+				state_ = kExpectPacketObjectStart;
+			}
+			else {
+				skip(kExpectMainNameOrEnd);
+			}
+			return true;
+		case kExpectPacketNameOrEnd:
+			if (strncmp(str, "head", len) == 0) {
+				got_head_ = true;
+				state_ = kExpectHead;
+			}
+			else if (strncmp(str, "data", len) == 0) {
+				state_ = kExpectDataStart;
+			}
+			else if (strncmp(str, "count", len) == 0) {
+				state_ = kExpectCount;
+			}
+			else if (strncmp(str, "round_seed", len) == 0) {
+				state_ = kExpectRoundSeed;
+			}
+			else if (strncmp(str, "first", len) == 0) {
+				state_ = kExpectFirst;
+			}
+			else {
+				skip(kExpectPacketNameOrEnd);
+			}
+			return true;
+		case kSkipValue:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	bool StartArray() {
+		switch (state_)
+		{
+		case kExpectDataStart:
+			got_data_ = true;
+			result->data.reset(0, expected_outputs);
+			result->data.reserve(expected_envs);
+			state_ = kExpectEnvDataStartOrEnd;
+			return true;
+		case kExpectEnvDataStartOrEnd:
+			start_row();
+			state_ = kExpectEnvDataOrEnd;
+			return true;
+		case kSkipValue:
+			skip_depth_++;
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	bool EndArray([[maybe_unused]] SizeType elementCount) {
+		switch (state_)
+		{
+		case kExpectEnvDataOrEnd:
+			result->data.set_valid(row_, column_ != 0);
+			state_ = kExpectEnvDataStartOrEnd;
+			return true;
+		case kExpectEnvDataStartOrEnd:
+			state_ = kExpectPacketNameOrEnd;
+			return true;
+		case kSkipValue:
+			return end_skipped();
+		default:
+			return false;
+		}
+	}
+
+	bool Double(double a) {
+		switch (state_)
+		{
+		case kExpectEnvDataOrEnd:
+			return push_value(a);
+		case kSkipValue:
+			return skip_scalar();
+		default:
+			return false;
+		}
+	}
+
+	bool Int64(int64_t a)
+	{
+		switch (state_)
+		{
+		case kExpectType:
+			if (packet_type(a) != packet_type::n_send_info)
+			{
+				throw std::runtime_error("nlab::get failed. Unknown packet type");
+			}
+			state_ = kExpectMainNameOrEnd;
+			return true;
+		case kExpectHead:
+			result->head = verification_header(a);
+			state_ = kExpectPacketNameOrEnd;
+			return true;
+		case kExpectCount:
+			lrinfo->count = static_cast<size_t>(a);
+			state_ = kExpectPacketNameOrEnd;
+			return true;
+		case kExpectRoundSeed:
+			lrinfo->round_seed = static_cast<size_t>(a);
+			state_ = kExpectPacketNameOrEnd;
+			return true;
+		case kExpectFirst:
+			lrinfo->first = static_cast<size_t>(a);
+			state_ = kExpectPacketNameOrEnd;
+			return true;
+		case kExpectEnvDataStartOrEnd:
+			result->data.append_row();
+			return (a == 0);
+		default:
+			return Double(static_cast<double>(a));
+		}
+	}
+
+	bool Null() { return Int64(0); }
+
+	bool Bool(bool a) { return Int64(a ? 1 : 0); }
+
+	bool Int(int a) { return Int64(a); }
+
+	bool Uint(unsigned a) { return Int64(a); }
+
+	bool Uint64(uint64_t a) { return Int64(static_cast<int64_t>(a)); }
+
+	bool String([[maybe_unused]] const Ch* str, [[maybe_unused]] SizeType len, [[maybe_unused]] bool copy) {
+		return state_ == kSkipValue && skip_scalar();
+	}
+
+	bool Default() { return false; }
+
+	n_send_info* result{ nullptr };
+	n_restart_info* lrinfo{ nullptr };
+
+	size_t expected_envs{ 0 };
+	size_t expected_outputs{ 0 };
+
+	StringStream* stream{ nullptr };
+	const char* stream_end{ nullptr };
 
+private:
+	enum State
+	{
+		kExpectMainObjectStart,
+		kExpectMainNameOrEnd,
+		kExpectType,
+		kExpectPacketObjectStart,
+		kExpectPacketNameOrEnd,
+		kExpectHead,
+		kExpectCount,
+		kExpectRoundSeed,
+		kExpectFirst,
+		kExpectDataStart,
+		kExpectEnvDataStartOrEnd,
+		kExpectEnvDataOrEnd,
+		kSkipValue
+	}state_{ kExpectMainObjectStart }, skip_return_{ kExpectMainObjectStart };
+
+	// Members the multiplexer doesn't know are skipped, as the DOM lookups did.
+	void skip(State return_state)
+	{
+		skip_return_ = return_state;
+		skip_depth_ = 0;
+		state_ = kSkipValue;
+	}
+
+	// Called for scalars inside the skipped value.
+	bool skip_scalar()
+	{
+		if (skip_depth_ == 0)
+			state_ = skip_return_;
+
+		return true;
+	}
+
+	// Called when an object or array inside the skipped value ends.
+	bool end_skipped()
+	{
+		if (--skip_depth_ == 0)
+			state_ = skip_return_;
+
+		return true;
+	}
+
+	// Rows longer than the output count are rejected.
+	bool push_value(double a)
+	{
+		if (column_ == result->data.width())
+			return false;
+
+		result->data.row(row_)[column_++] = a;
+		return true;
+	}
+
+	void start_row()
+	{
+		row_ = result->data.append_row();
+		column_ = 0;
+
+		if (!parse_stream_task(stream, stream_end, [this](double a) { return push_value(a); }))
+		{
+			std::fill_n(result->data.row(row_), column_, 0.0);
+			column_ = 0;
+		}
+	}
+
+	size_t row_{ 0 };
+	size_t column_{ 0 };
+	size_t skip_depth_{ 0 };
+
+	bool got_type_{ false };
+	bool got_packet_{ false };
+	bool got_head_{ false };
+	bool got_data_{ false };
+};
+
+int nlab::connect()
+{
 	pipe_->connect();
 	return 0;
 }
@@ -19,10 +292,7 @@ n_start_info nlab::get_start_info()
 	void* buf = nullptr;
 	size_t sz = 0;
 
-	while (sz == 0)
-	{
-		pipe_->receive(&buf, sz);
-	}
+	pipe_->receive_wait(&buf, sz);
 
 	Document doc;
 
@@ -45,6 +315,12 @@ n_start_info nlab::get_start_info()
 	nsi.count = desi["count"].GetUint64();
 	nsi.round_seed = desi["round_seed"].GetUint64();
 
+	binary_ = desi.HasMember("encoding") && desi["encoding"].IsString() &&
+		strcmp(desi["encoding"].GetString(), "binary") == 0 && offers_binary();
+
+	async_restart_ = async_restart_ && desi.HasMember("restart") && desi["restart"].IsString() &&
+		strcmp(desi["restart"].GetString(), "async") == 0;
+
 	state_.count = nsi.count;
 	state_.round_seed = nsi.round_seed;
 
@@ -76,6 +352,17 @@ int nlab::set_start_info(const e_start_info& inf)
 	doc.Uint64(inf.incount);
 	doc.String("outcount");
 	doc.Uint64(inf.outcount);
+	if (offers_binary())
+	{
+		doc.String("encoding");
+		doc.String("binary");
+		async_restart_ = false;
+	}
+	if (async_restart_)
+	{
+		doc.String("restart");
+		doc.String("async");
+	}
 	doc.EndObject();
 	doc.EndObject();
 	s.Put('\0');
@@ -84,146 +371,263 @@ int nlab::set_start_info(const e_start_info& inf)
 	return 0;
 }
 
-n_send_info nlab::get()
+int nlab::get(n_send_info& nsi)
 {
-	if (last_dom_buffer_sz_ > dom_buffer_.size())
+	void* buf = nullptr;
+	size_t sz = 0;
+
+	pipe_->receive_wait(&buf, sz);
+
+	nsi.head = verification_header::fail;
+	nsi.data.clear();
+	nsi.raw.clear();
+
+	if (binary_ && is_binary_packet(static_cast<char*>(buf), sz))
 	{
-		dom_buffer_.resize(last_dom_buffer_sz_);
+		read_binary(static_cast<char*>(buf), sz, nsi);
+		return 0;
 	}
 
-	if (last_stack_buffer_sz_ > stack_buffer_.size())
+	if (passthrough_ && read_raw(static_cast<char*>(buf), sz, nsi))
 	{
-		stack_buffer_.resize(last_stack_buffer_sz_);
+		return 0;
 	}
 
-	void* buf = nullptr;
-	size_t sz = 0;
-	
+	stack_buffer_.reserve(std::max(last_stack_buffer_sz_, stack_default_sz_));
+
+	MemoryPoolAllocator<> stack_allocator{ stack_buffer_.data(), stack_buffer_.capacity() };
+
+	GenericReader<UTF8<>, UTF8<>, MemoryPoolAllocator<>> reader(&stack_allocator,
+		stack_buffer_.capacity());
+	StringStream ss(static_cast<char*>(buf));
 
-	while (sz == 0)
+	n_send_info_parser handler;
+	handler.expected_envs = state_.count;
+	handler.expected_outputs = state_.outcount;
+	handler.result = &nsi;
+	handler.lrinfo = &lrinfo_;
+	lrinfo_.first = n_restart_info::all_envs;
+	handler.stream = &ss;
+	handler.stream_end = static_cast<char*>(buf) + sz;
+
+	reader.Parse(ss, handler);
+
+	if (reader.HasParseError())
 	{
-		pipe_->receive(&buf, sz);
+		throw std::runtime_error("nlab::get failed. JSON parse error");
 	}
 
-	MemoryPoolAllocator<> dom_allocator{ dom_buffer_.data(), dom_buffer_.size() };
-	MemoryPoolAllocator<> stack_allocator{ stack_buffer_.data(), stack_buffer_.size() };
+	lasthead_ = nsi.head;
+	if (nsi.head != verification_header::ok)
+	{
+		nsi.data.clear();
+	}
 
-	GenericDocument<UTF8<>, MemoryPoolAllocator<>, MemoryPoolAllocator<>>
-		doc(&dom_allocator, stack_allocator.Capacity(), &stack_allocator);
+	last_stack_buffer_sz_ = stack_allocator.Size();
 
-	doc.Parse(static_cast< char* >(buf));
-	if (doc.HasParseError())
+	return 0;
+}
+
+bool nlab::read_raw(const char* buf, size_t sz, n_send_info& nsi)
+{
+	static const std::string type_text = std::to_string(static_cast<int>(packet_type::n_send_info));
+
+	json_member members[] = { { "type" }, { "head" }, { "data" } };
+	json_scan_members(buf, buf + sz, members, 3);
+
+	auto& type = members[0];
+	auto& head = members[1];
+	auto& data = members[2];
+
+	if (!type.begin || !head.begin || !data.begin || *data.begin != '[' ||
+		!json_equals(head.begin, head.end, "0"))
 	{
-		throw std::runtime_error("nlab::get failed. JSON parse error");
+		return false;
 	}
 
-	packet_type ptype;
-	ptype = packet_type(doc["type"].GetInt());
-	if (ptype != packet_type::n_send_info)
+	if (!json_equals(type.begin, type.end, type_text.c_str()))
 	{
 		throw std::runtime_error("nlab::get failed. Unknown packet type");
 	}
 
-	n_send_info nsi;
-	auto& dnsi = doc["n_send_info"];
-	nsi.head = verification_header(dnsi["head"].GetInt());
+	nsi.head = verification_header::ok;
 	lasthead_ = nsi.head;
 
-	if (nsi.head != verification_header::ok)
+	nsi.raw.clear();
+	json_for_each_element(data.begin, data.end, [&nsi](const char* begin, const char* end)
 	{
-		if (nsi.head == verification_header::restart)
-		{
-			lrinfo_.count = dnsi["count"].GetUint64();
-			lrinfo_.round_seed = dnsi["round_seed"].GetUint64();
-		}
+		nsi.raw.append(begin, end);
+	});
+
+	return true;
+}
 
-		return nsi;
+void nlab::read_binary(const char* buf, size_t sz, n_send_info& nsi)
+{
+	auto hdr = read_binary_header(buf, sz);
+
+	if (packet_type(hdr.type) != packet_type::n_send_info)
+	{
+		throw std::runtime_error("nlab::get failed. Unknown packet type");
 	}
 
-	auto& data = dnsi["data"];
-	nsi.data.reserve(data.Size());
-	for (auto i = data.Begin(); i != data.End(); i++)
+	nsi.head = verification_header(hdr.head);
+	lasthead_ = nsi.head;
+
+	if (nsi.head == verification_header::restart)
 	{
-		nsi.data.emplace_back();
+		throw std::runtime_error("nlab::get failed. Restart packets must be JSON");
+	}
 
-		env_task& cur_tsk = nsi.data.back();
-		cur_tsk.reserve(i->Size());
-		for (auto j = i->Begin(); j != i->End(); j++)
-		{
-			cur_tsk.push_back(j->GetDouble());
-		}
+	if (nsi.head != verification_header::ok)
+	{
+		return;
 	}
 
-	last_dom_buffer_sz_ = dom_allocator.Size();
-	last_stack_buffer_sz_ = stack_allocator.Size();
+	if (hdr.count > state_.count || (hdr.count != 0 && hdr.width != state_.outcount))
+	{
+		throw std::runtime_error("nlab::get failed. Binary packet shape doesn't match the start info");
+	}
 
-	return nsi;
+	const char* values = buf + binary_header_size;
+
+	nsi.data.reset(hdr.count, hdr.width);
+	nsi.data.set_all_valid();
+	read_doubles(nsi.data.data(), values, static_cast<size_t>(hdr.count) * hdr.width);
 }
 
-int nlab::set(const e_send_info & inf)
+void nlab::write_binary(const e_send_info& inf)
 {
-	if (last_dom_buffer_sz_ > dom_buffer_.size())
-	{
-		dom_buffer_.resize(last_dom_buffer_sz_);
-	}
+	size_t count = inf.data.rows();
+	size_t width = state_.incount;
 
-	if (last_stack_buffer_sz_ > stack_buffer_.size())
+	if (count != 0 && inf.data.width() != width)
 	{
-		stack_buffer_.resize(last_stack_buffer_sz_);
+		throw std::runtime_error("nlab::set failed. Row size doesn't match incount");
 	}
 
-	using StringBufferType = GenericStringBuffer<UTF8<>, MemoryPoolAllocator<>>;
-	MemoryPoolAllocator<> dom_allocator{ dom_buffer_.data(), dom_buffer_.size() };
-	MemoryPoolAllocator<> stack_allocator{ stack_buffer_.data(), stack_buffer_.size() };
+	size_t mask = binary_mask_size(count);
+	size_t sz = binary_packet_size(count, width, mask);
 
-	StringBufferType s{ &dom_allocator, dom_allocator.Capacity() };
-	Writer< StringBufferType, UTF8<>, UTF8<>, MemoryPoolAllocator<> > doc(s, &stack_allocator);
+	dom_buffer_.reserve(sz);
 
-	doc.StartObject();
-	doc.String("type");
-	doc.Int(static_cast<int>(packet_type::e_send_info));
-	doc.String("e_send_info");
-	doc.StartObject();
-	doc.String("head");
-	doc.Int(static_cast<int>(inf.head));
+	binary_header hdr;
+	hdr.type = static_cast<std::uint16_t>(packet_type::e_send_info);
+	hdr.head = static_cast<std::uint16_t>(inf.head);
+	hdr.count = static_cast<std::uint32_t>(count);
+	hdr.width = static_cast<std::uint32_t>(width);
+	write_binary_header(dom_buffer_.data(), hdr);
+
+	char* active = dom_buffer_.data() + binary_header_size;
+	char* values = active + mask;
+
+	std::memset(active, 0, mask);
+	if (count != 0)
+		std::memcpy(active, inf.data.mask(), count);
+
+	// invalid rows of a batch are zero-filled already
+	write_doubles(values, inf.data.data(), count * width);
+	values += count * width * sizeof(double);
+
+	*values = '\0';
+
+	pipe_->send(dom_buffer_.data(), sz);
+}
+
+void nlab::write_binary_scores(const e_restart_info& inf)
+{
+	size_t sz = binary_packet_size(inf.result.size(), 1);
+
+	dom_buffer_.reserve(sz);
+
+	binary_header hdr;
+	hdr.type = static_cast<std::uint16_t>(packet_type::e_send_info);
+	hdr.head = static_cast<std::uint16_t>(verification_header::restart);
+	hdr.count = static_cast<std::uint32_t>(inf.result.size());
+	hdr.width = 1;
+	write_binary_header(dom_buffer_.data(), hdr);
 
-	if (inf.head == verification_header::ok)
+	write_doubles(dom_buffer_.data() + binary_header_size, inf.result.data(), inf.result.size());
+	dom_buffer_.data()[sz - 1] = '\0';
+
+	pipe_->send(dom_buffer_.data(), sz);
+}
+
+int nlab::set(const e_send_info & inf)
+{
+	if (!binary_)
+		throw std::logic_error("nlab::set: JSON batches are sent with set_rows");
+
+	write_binary(inf);
+	return 0;
+}
+
+int nlab::set_rows(const std::vector<const json_rows*>& rows)
+{
+	int n = std::snprintf(rows_prefix_, sizeof(rows_prefix_),
+		"{\"type\":%d,\"e_send_info\":{\"head\":%d,\"data\":[",
+		static_cast<int>(packet_type::e_send_info), static_cast<int>(verification_header::ok));
+
+	static const char separator[] = ",";
+	static const char suffix[] = "]}}";
+
+	gather_.clear();
+	gather_.push_back({ rows_prefix_, static_cast<size_t>(n) });
+
+	bool first = true;
+	for (auto r : rows)
 	{
-		doc.String("data");
-		doc.StartArray();
-		for (auto& i : inf.data)
-		{
-			if (i.empty()) {
-				doc.Null();
-				continue;
-			}
+		if (r->text.empty())
+			continue;
 
-			doc.StartArray();
-			for (auto& j : i)
-			{
-				doc.Double(j);
-			}
-			doc.EndArray();
-		}
-		doc.EndArray();
-	}
+		if (!first)
+			gather_.push_back({ separator, 1 });
 
-	doc.EndObject();
-	doc.EndObject();
-	s.Put('\0');
+		gather_.push_back({ r->text.data(), r->text.size() });
+		first = false;
+	}
 
-	pipe_->send(s.GetString(), s.GetSize());
+	gather_.push_back({ suffix, sizeof(suffix) - 1 });
 
-	last_dom_buffer_sz_ = dom_allocator.Size();
-	last_stack_buffer_sz_ = stack_allocator.Size();
+	pipe_->send_gather(gather_.data(), gather_.size());
 
 	return 0;
 }
 
 int nlab::restart(const e_restart_info & inf)
 {
-	StringBuffer s;
-	Writer< StringBuffer > doc(s);
+	if (binary_)
+	{
+		write_binary_scores(inf);
+		return 0;
+	}
+
+	write_scores(inf, nullptr);
+	return 0;
+}
+
+int nlab::restart_env(const n_restart_info& env, const e_restart_info& inf)
+{
+	if (binary_)
+		throw std::logic_error("nlab::restart_env: async restarts aren't used with the binary encoding");
+
+	write_scores(inf, &env);
+	return 0;
+}
+
+// Restart scores as JSON, for all envs or for the one env given.
+void nlab::write_scores(const e_restart_info& inf, const n_restart_info* env)
+{
+	dom_buffer_.reserve(std::max(last_dom_buffer_sz_, dom_default_sz_));
+
+	stack_buffer_.reserve(std::max(last_stack_buffer_sz_, stack_default_sz_));
+
+	using StringBufferType = GenericStringBuffer<UTF8<>, MemoryPoolAllocator<>>;
+	MemoryPoolAllocator<> dom_allocator{ dom_buffer_.data(), dom_buffer_.capacity() };
+	MemoryPoolAllocator<> stack_allocator{ stack_buffer_.data(), stack_buffer_.capacity() };
+
+	StringBufferType s{ &dom_allocator, dom_allocator.Capacity() };
+	Writer< StringBufferType, UTF8<>, UTF8<>, MemoryPoolAllocator<> > doc(s, &stack_allocator);
 	doc.StartObject();
 	doc.String("type");
 	doc.Int(static_cast<int>(packet_type::e_send_info));
@@ -232,13 +636,16 @@ int nlab::restart(const e_restart_info & inf)
 	doc.String("head");
 	doc.Int(static_cast<int>(verification_header::restart));
 
-	doc.String("score");
-	doc.StartArray();
-	for (auto& i : inf.result)
+	if (env != nullptr)
 	{
-		doc.Double(i);
+		doc.String("first");
+		doc.Uint64(env->first);
+		doc.String("count");
+		doc.Uint64(env->count);
 	}
-	doc.EndArray();
+
+	doc.String("score");
+	write_values(doc, s, inf.result, float_digits_);
 
 	doc.EndObject();
 	doc.EndObject();
@@ -246,7 +653,8 @@ int nlab::restart(const e_restart_info & inf)
 
 	pipe_->send(s.GetString(), s.GetSize());
 
-	return 0;
+	last_dom_buffer_sz_ = dom_allocator.Size();
+	last_stack_buffer_sz_ = stack_allocator.Size();
 }
 
 int nlab::stop()
@@ -275,12 +683,10 @@ int nlab::disconnect()
 {
 	pipe_->disconnect();
 
-	dom_buffer_.resize(dom_default_sz_);
-	dom_buffer_.shrink_to_fit();
+	dom_buffer_.reset();
 	last_dom_buffer_sz_ = 0;
 
-	stack_buffer_.resize(stack_default_sz_);
-	stack_buffer_.shrink_to_fit();
+	stack_buffer_.reset();
 	last_stack_buffer_sz_ = 0;
 
 	return 0;
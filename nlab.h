@@ -2,6 +2,7 @@
 
 #include <cstdint>
 #include <memory>
+#include <vector>
 
 #include "remote_env.h"
 
@@ -11,14 +12,28 @@ class nlab {
 	env_state state_{};
 	n_restart_info lrinfo_{};
 
-	static const size_t dom_default_sz_ = 64 * 1024u;
-	static const size_t stack_default_sz_ = 4 * 1024u;
+	static constexpr size_t dom_default_sz_ = 64 * 1024u;
+	static constexpr size_t stack_default_sz_ = 4 * 1024u;
 
 	size_t last_dom_buffer_sz_{};
 	size_t last_stack_buffer_sz_{};
 
-	std::vector<std::uint8_t> dom_buffer_;
-	std::vector<std::uint8_t> stack_buffer_;
+	pooled_buffer dom_buffer_;
+	pooled_buffer stack_buffer_;
+
+	bool binary_{ false };
+	bool passthrough_{ false };
+	bool async_restart_{ false };
+	int float_digits_{ 0 };
+
+	std::vector<send_buffer> gather_;
+	char rows_prefix_[64]{};
+
+	void read_binary(const char* buf, size_t sz, n_send_info& nsi);
+	bool read_raw(const char* buf, size_t sz, n_send_info& nsi);
+	void write_binary(const e_send_info& inf);
+	void write_binary_scores(const e_restart_info& inf);
+	void write_scores(const e_restart_info& inf, const n_restart_info* env);
 
 public:
 	static const unsigned VERSION = 0x00000100;
@@ -38,17 +53,65 @@ public:
 		return state_;
 	}
 
+	// Offers nlab to restart envs one by one, see restart_env. Set before
+	// the start info; is_async_restart tells whether nlab accepted. Not
+	// offered together with the binary encoding, which has no per-env form
+	// of the restart scores.
+	void set_async_restart(bool async_restart)
+	{
+		async_restart_ = async_restart;
+	}
+
+	// Whether the start info offers nlab the binary encoding.
+	bool offers_binary() const
+	{
+		return pipe_->is_binary_safe() && !passthrough_;
+	}
+
+	bool is_async_restart() const
+	{
+		return async_restart_;
+	}
+
+	// Whether nlab accepted the binary encoding for data packets.
+	bool is_binary() const
+	{
+		return binary_;
+	}
+
+	// Data rows are forwarded as JSON text in e_send_info::raw / n_send_info::raw.
+	void set_passthrough(bool passthrough)
+	{
+		passthrough_ = passthrough;
+	}
+
+	// Significant digits of the written observations and scores, 0 for the shortest exact text.
+	void set_float_digits(int digits)
+	{
+		float_digits_ = digits;
+	}
+
 	int connect();
 	n_start_info get_start_info();
 	int set_start_info(const e_start_info& inf);
-	n_send_info get();
+	int get(n_send_info& nsi);
+	// Sends the batch as a binary packet, only for the binary encoding.
 	int set(const e_send_info& inf);
+	// Sends an ok e_send_info whose data rows are already JSON text, one
+	// json_rows per env in batch order. The env texts are gathered into the
+	// packet where they are, without building it in one buffer. Only for the
+	// JSON encoding.
+	int set_rows(const std::vector<const json_rows*>& rows);
 	int restart(const e_restart_info& inf);
+	// Sends the scores of one env that finished its episode. nlab answers with
+	// a restart n_send_info for the same slot, which get() reads into the
+	// restart info.
+	int restart_env(const n_restart_info& env, const e_restart_info& inf);
 	int stop();
 	int disconnect();
 
-	explicit nlab(std::unique_ptr<base_stream>&& a) :
-		pipe_(std::move(a))
+	nlab(std::unique_ptr<base_stream>&& a, buffer_pool& pool) :
+		pipe_(std::move(a)), dom_buffer_(pool), stack_buffer_(pool)
 	{
 	}
 
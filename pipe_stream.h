@@ -0,0 +1,333 @@
+#pragma once
+
+#include "event_loop.h"
+#include "framing.h"
+#include "remote_env.h"
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+#include "tiny-process-library/process.hpp"
+
+// Talks the env protocol over the stdin/stdout pipes of a child process that
+// the stream spawns itself in create(). Packets written by the child to stdout
+// are collected by the process reader thread and handed to the event loop.
+// The child must keep its own diagnostics on stderr. A watcher thread waits
+// for the child to exit; once its remaining packets are consumed, receive()
+// throws instead of waiting for output that never comes.
+
+class pipe_stream : public base_stream
+{
+	event_loop& loop_;
+	std::string command_;
+	framing_mode framing_;
+
+	std::unique_ptr<TinyProcessLib::Process> process_;
+
+	std::mutex mutex_;
+	std::vector<char> incoming_;
+	size_t complete_{ 0 };
+	size_t scanned_{ 0 };
+	std::function<void()> handler_;
+	std::optional<asio::io_service::work> work_;
+	// guarded by mutex_, as only the armed handler is ever posted
+	handler_memory wait_memory_;
+	bool exited_{ false };
+	int exit_status_{ 0 };
+	std::thread exit_watcher_;
+
+	std::vector<char> current_;
+
+	void on_output(const char* bytes, size_t n);
+	void on_exit(int status);
+	void post_handler();
+	size_t frame_end(size_t start) const;
+
+public:
+	pipe_stream(event_loop& loop, std::string command,
+		framing_mode framing = framing_mode::nul);
+	pipe_stream(const pipe_stream&) = delete;
+
+	pipe_stream& operator =(const pipe_stream& a) = delete;
+	~pipe_stream();
+	void receive(void** ppd, size_t& sz) override;
+	void send(const void* pd, size_t sz) override;
+	void send_gather(const send_buffer* bufs, size_t count) override;
+	bool is_connected() const override;
+
+	bool is_binary_safe() const override
+	{
+		return framing_ == framing_mode::length;
+	}
+
+	void on_readable(std::function<void()> handler) override;
+	void wait_readable() override;
+	void connect() override;
+	void disconnect() override;
+
+	void create() override;
+	void wait() override;
+	void close() override;
+
+	TinyProcessLib::Process::id_type get_id() const
+	{
+		return process_ ? process_->get_id() : 0;
+	}
+};
+
+inline pipe_stream::pipe_stream(event_loop& loop, std::string command, framing_mode framing)
+	: loop_(loop), command_(command), framing_(framing)
+{
+}
+
+inline pipe_stream::~pipe_stream()
+{
+	if (process_)
+	{
+		bool exited;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			exited = exited_;
+		}
+
+		if (!exited)
+			process_->kill();
+	}
+
+	if (exit_watcher_.joinable())
+		exit_watcher_.join();
+
+	process_.reset();
+}
+
+inline size_t pipe_stream::frame_end(size_t start) const
+{
+	if (incoming_.size() - start < frame_header_size)
+		return 0;
+
+	size_t end = start + frame_header_size +
+		read_frame_header(reinterpret_cast<const unsigned char*>(incoming_.data() + start));
+
+	return end <= incoming_.size() ? end : 0;
+}
+
+inline void pipe_stream::on_output(const char* bytes, size_t n)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	{
+		buffer_growth growth;
+		incoming_.insert(incoming_.end(), bytes, bytes + n);
+	}
+
+	if (framing_ == framing_mode::length)
+	{
+		for (size_t end = frame_end(scanned_); end != 0; end = frame_end(scanned_))
+		{
+			scanned_ = end;
+			complete_++;
+		}
+	}
+	else
+	{
+		complete_ += std::count(bytes, bytes + n, '\0');
+	}
+
+	if (complete_ != 0)
+		post_handler();
+}
+
+// get_exit_status joins the process reader thread, so all output of the child
+// has been through on_output by now.
+inline void pipe_stream::on_exit(int status)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	exited_ = true;
+	exit_status_ = status;
+	post_handler();
+}
+
+inline void pipe_stream::post_handler()
+{
+	if (!handler_)
+		return;
+
+	asio::post(loop_.service(), bind_memory(wait_memory_, std::move(handler_)));
+	handler_ = nullptr;
+	work_.reset();
+}
+
+inline void pipe_stream::receive(void** ppd, size_t& sz)
+{
+	sz = 0;
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (complete_ == 0)
+	{
+		if (exited_)
+			throw std::runtime_error("pipe error: environment exited with status " +
+				std::to_string(exit_status_));
+		return;
+	}
+
+	buffer_growth growth;
+
+	if (framing_ == framing_mode::length)
+	{
+		size_t end = frame_end(0);
+
+		current_.assign(incoming_.begin() + frame_header_size, incoming_.begin() + end);
+		sz = current_.size();
+		current_.push_back('\0');
+
+		incoming_.erase(incoming_.begin(), incoming_.begin() + end);
+		scanned_ -= end;
+	}
+	else
+	{
+		auto end = std::find(incoming_.begin(), incoming_.end(), '\0') + 1;
+
+		if (end == incoming_.end())
+		{
+			current_.swap(incoming_);
+			incoming_.clear();
+		}
+		else
+		{
+			current_.assign(incoming_.begin(), end);
+			incoming_.erase(incoming_.begin(), end);
+		}
+
+		sz = current_.size();
+	}
+
+	complete_--;
+
+	*ppd = current_.data();
+}
+
+inline void pipe_stream::send(const void* pd, size_t sz)
+{
+	if (!process_)
+		throw std::runtime_error("pipe error: environment isn't started");
+
+	bool written;
+
+	if (framing_ == framing_mode::length)
+	{
+		if (sz > 0 && static_cast<const char*>(pd)[sz - 1] == '\0')
+			sz--;
+
+		unsigned char hdr[frame_header_size];
+		write_frame_header(hdr, sz);
+
+		written = process_->write(reinterpret_cast<const char*>(hdr), frame_header_size) &&
+			process_->write(static_cast<const char*>(pd), sz);
+	}
+	else
+	{
+		written = process_->write(static_cast<const char*>(pd), sz);
+	}
+
+	if (!written)
+		throw std::runtime_error("pipe error: couldn't write to environment stdin");
+}
+
+// The pipe has no vectored write, the pieces are written one by one.
+inline void pipe_stream::send_gather(const send_buffer* bufs, size_t count)
+{
+	if (!process_)
+		throw std::runtime_error("pipe error: environment isn't started");
+
+	bool written = true;
+
+	if (framing_ == framing_mode::length)
+	{
+		size_t sz = 0;
+		for (size_t i = 0; i < count; i++)
+			sz += bufs[i].size;
+
+		unsigned char hdr[frame_header_size];
+		write_frame_header(hdr, sz);
+
+		written = process_->write(reinterpret_cast<const char*>(hdr), frame_header_size);
+	}
+
+	for (size_t i = 0; i < count && written; i++)
+	{
+		if (bufs[i].size != 0)
+			written = process_->write(static_cast<const char*>(bufs[i].data), bufs[i].size);
+	}
+
+	if (written && framing_ == framing_mode::nul)
+		written = process_->write("", 1);
+
+	if (!written)
+		throw std::runtime_error("pipe error: couldn't write to environment stdin");
+}
+
+inline bool pipe_stream::is_connected() const
+{
+	return process_ != nullptr;
+}
+
+inline void pipe_stream::on_readable(std::function<void()> handler)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (complete_ != 0 || exited_)
+	{
+		asio::post(loop_.service(), bind_memory(wait_memory_, std::move(handler)));
+		return;
+	}
+
+	handler_ = std::move(handler);
+	work_.emplace(loop_.service());
+}
+
+inline void pipe_stream::wait_readable()
+{
+	bool readable = false;
+	on_readable([&readable]() { readable = true; });
+	loop_.run_until([&readable]() { return readable; });
+}
+
+inline void pipe_stream::connect()
+{
+	throw std::runtime_error("pipe error: pipe streams can't connect to a running peer");
+}
+
+inline void pipe_stream::disconnect()
+{
+	if (process_)
+		process_->close_stdin();
+}
+
+inline void pipe_stream::create()
+{
+	if (process_)
+		throw std::runtime_error("pipe error: environment already started");
+
+	process_ = std::make_unique<TinyProcessLib::Process>(command_, "",
+		[this](const char* bytes, size_t n) { on_output(bytes, n); }, nullptr, true);
+
+	exit_watcher_ = std::thread([this]() { on_exit(process_->get_exit_status()); });
+}
+
+inline void pipe_stream::wait()
+{
+}
+
+inline void pipe_stream::close()
+{
+	disconnect();
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	handler_ = nullptr;
+	work_.reset();
+}
@@ -0,0 +1,277 @@
+#include "plugin_env.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+plugin_library::plugin_library(const std::string& path)
+{
+#if defined(_WIN32)
+	HMODULE module = LoadLibraryA(path.c_str());
+	if (!module)
+		throw std::runtime_error("couldn't load plugin " + path);
+
+	handle_ = module;
+	auto entry = reinterpret_cast<menv_get_plugin_fn>(GetProcAddress(module, "menv_get_plugin"));
+#else
+	handle_ = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+	if (!handle_)
+		throw std::runtime_error("couldn't load plugin " + path + ": " + dlerror());
+
+	auto entry = reinterpret_cast<menv_get_plugin_fn>(dlsym(handle_, "menv_get_plugin"));
+#endif
+
+	if (!entry)
+		throw std::runtime_error("plugin " + path + " doesn't export menv_get_plugin");
+
+	api_ = entry();
+
+	if (!api_ || api_->abi_version != MENV_PLUGIN_ABI_VERSION)
+		throw std::runtime_error("plugin " + path + " has incompatible ABI version");
+
+	if (!api_->create || !api_->get_start_info || !api_->start || !api_->observe ||
+		!api_->step || !api_->stop || !api_->destroy)
+		throw std::runtime_error("plugin " + path + " misses required entry points");
+}
+
+plugin_library::~plugin_library()
+{
+#if defined(_WIN32)
+	FreeLibrary(static_cast<HMODULE>(handle_));
+#else
+	dlclose(handle_);
+#endif
+}
+
+plugin_env::~plugin_env()
+{
+	terminate();
+}
+
+int plugin_env::init()
+{
+	inst_ = lib_->api().create(index_);
+	if (!inst_)
+		throw std::runtime_error("plugin failed to create environment " + std::to_string(index_));
+
+	return 0;
+}
+
+int plugin_env::wait()
+{
+	return 0;
+}
+
+e_start_info plugin_env::get_start_info()
+{
+	menv_start_info info{};
+
+	if (lib_->api().get_start_info(inst_, &info) != MENV_OK)
+		throw std::runtime_error("GetStartInfo failed. Plugin error");
+
+	e_start_info esi;
+	esi.mode = send_modes(info.mode);
+	esi.count = info.count;
+	esi.incount = info.incount;
+	esi.outcount = info.outcount;
+
+	state_.mode = esi.mode;
+	state_.count = esi.count;
+	state_.incount = esi.incount;
+	state_.outcount = esi.outcount;
+	return esi;
+}
+
+int plugin_env::set_start_info(const n_start_info& inf)
+{
+	if (state_.mode == send_modes::specified && inf.count != state_.count)
+	{
+		throw std::runtime_error("SetStartInfo failed. Count mismatch");
+	}
+
+	if (state_.mode == send_modes::undefined && state_.count != 0 && inf.count > state_.count)
+	{
+		throw std::runtime_error("SetStartInfo failed. Count mismatch");
+	}
+
+	state_.count = inf.count;
+	state_.round_seed = inf.round_seed;
+
+	post_round(false, true);
+	return 0;
+}
+
+void plugin_env::post_round(bool do_step, bool do_start)
+{
+	inputs_.resize(state_.count * state_.incount);
+	scores_.resize(state_.count);
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		busy_ = true;
+		done_ = false;
+	}
+
+	round_.do_step = do_step;
+	round_.do_start = do_start;
+	round_.count = state_.count;
+	round_.seed = state_.round_seed;
+
+	workers_.post(round_);
+}
+
+void plugin_env::round_job::run()
+{
+	env->run_round(*this);
+}
+
+void plugin_env::run_round(const round_job& job)
+{
+	auto& api = lib_->api();
+	int result = MENV_OK;
+
+	if (job.do_start)
+		result = api.start(inst_, job.count, job.seed);
+
+	if (result == MENV_OK && job.do_step)
+		result = api.step(inst_, outputs_.data());
+
+	if (result == MENV_OK)
+		result = api.observe(inst_, inputs_.data(), scores_.data());
+
+	complete(result);
+}
+
+void plugin_env::complete(int result)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	result_ = result;
+	busy_ = false;
+	done_ = true;
+	idle_.notify_all();
+
+	if (handler_)
+	{
+		asio::post(loop_.service(), bind_memory(wait_memory_, std::move(handler_)));
+		handler_ = nullptr;
+		work_.reset();
+	}
+}
+
+bool plugin_env::ready()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return done_;
+}
+
+void plugin_env::on_ready(std::function<void()> handler)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (done_)
+	{
+		asio::post(loop_.service(), bind_memory(wait_memory_, std::move(handler)));
+		return;
+	}
+
+	handler_ = std::move(handler);
+	work_.emplace(loop_.service());
+}
+
+int plugin_env::get(e_send_info& esi)
+{
+	while (!ready())
+	{
+		bool readable = false;
+		on_ready([&readable]() { readable = true; });
+		loop_.run_until([&readable]() { return readable; });
+	}
+
+	esi.data.clear();
+	esi.raw.clear();
+	esi.head = result_ <= MENV_FAIL && result_ >= MENV_OK ?
+		verification_header(result_) : verification_header::fail;
+	lasthead_ = esi.head;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		done_ = false;
+	}
+
+	if (esi.head == verification_header::restart)
+	{
+		lrinfo_.result.assign(scores_.begin(), scores_.end());
+	}
+	else if (esi.head == verification_header::ok)
+	{
+		esi.data.reset(state_.count, state_.incount);
+		esi.data.set_all_valid();
+		std::copy_n(inputs_.begin(), state_.count * state_.incount, esi.data.data());
+	}
+
+	return 0;
+}
+
+int plugin_env::set(const n_send_view& inf)
+{
+	outputs_.assign(state_.count * state_.outcount, 0.0);
+
+	size_t width = std::min(inf.data.width(), state_.outcount);
+	for (size_t i = 0; i < inf.data.rows() && i < state_.count; i++)
+	{
+		std::copy_n(inf.data.row(i), width, outputs_.begin() + i * state_.outcount);
+	}
+
+	post_round(true, false);
+	return 0;
+}
+
+int plugin_env::restart(const n_restart_info& inf)
+{
+	state_.count = inf.count;
+	state_.round_seed = inf.round_seed;
+
+	post_round(false, true);
+	return 0;
+}
+
+void plugin_env::wait_idle()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	idle_.wait(lock, [this]() { return !busy_; });
+}
+
+int plugin_env::stop()
+{
+	if (inst_)
+	{
+		wait_idle();
+		lib_->api().stop(inst_);
+	}
+
+	terminate();
+	return 0;
+}
+
+int plugin_env::terminate()
+{
+	wait_idle();
+
+	if (inst_)
+	{
+		lib_->api().destroy(inst_);
+		inst_ = nullptr;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	done_ = false;
+	handler_ = nullptr;
+	work_.reset();
+	return 0;
+}
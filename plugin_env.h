@@ -0,0 +1,116 @@
+#pragma once
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "env.h"
+#include "event_loop.h"
+#include "menv_plugin.h"
+#include "worker_pool.h"
+
+class plugin_library
+{
+	void* handle_{ nullptr };
+	const menv_plugin* api_{ nullptr };
+
+public:
+	explicit plugin_library(const std::string& path);
+	plugin_library(const plugin_library&) = delete;
+	plugin_library& operator=(const plugin_library&) = delete;
+	~plugin_library();
+
+	const menv_plugin& api() const
+	{
+		return *api_;
+	}
+};
+
+class plugin_env : public base_env
+{
+	std::shared_ptr<plugin_library> lib_;
+	event_loop& loop_;
+	worker_pool& workers_;
+	unsigned index_;
+	void* inst_{ nullptr };
+
+	verification_header lasthead_{};
+	env_state state_{};
+	e_restart_info lrinfo_{};
+
+	std::vector<double> inputs_;
+	std::vector<double> outputs_;
+	std::vector<double> scores_;
+
+	std::mutex mutex_;
+	std::condition_variable idle_;
+	bool busy_{ false };
+	bool done_{ false };
+	int result_{ MENV_FAIL };
+	std::function<void()> handler_;
+	std::optional<asio::io_service::work> work_;
+	// guarded by mutex_, as only one handler is ever posted at a time
+	handler_memory wait_memory_;
+
+	struct round_job : worker_job
+	{
+		plugin_env* env{ nullptr };
+		bool do_step{ false };
+		bool do_start{ false };
+		size_t count{ 0 };
+		size_t seed{ 0 };
+
+		void run() override;
+	};
+
+	round_job round_;
+
+	void post_round(bool do_step, bool do_start);
+	void run_round(const round_job& job);
+	void complete(int result);
+	void wait_idle();
+
+public:
+	int init() override;
+	int wait() override;
+
+	e_start_info get_start_info() override;
+	int set_start_info(const n_start_info& inf) override;
+
+	bool ready() override;
+	void on_ready(std::function<void()> handler) override;
+	int get(e_send_info& esi) override;
+	int set(const n_send_view& inf) override;
+	int restart(const n_restart_info& inf) override;
+
+	int stop() override;
+	int terminate() override;
+
+	verification_header get_header() const override
+	{
+		return lasthead_;
+	}
+
+	const e_restart_info& get_restart_info() const override
+	{
+		return lrinfo_;
+	}
+
+	env_state get_state() const override
+	{
+		return state_;
+	}
+
+	plugin_env(std::shared_ptr<plugin_library> lib, event_loop& loop, worker_pool& workers,
+		unsigned index) :
+		lib_(std::move(lib)), loop_(loop), workers_(workers), index_(index)
+	{
+		round_.env = this;
+	}
+
+	plugin_env(const plugin_env& a) = delete;
+	~plugin_env();
+};
@@ -1,5 +1,10 @@
 #include "remote_env.h"
+#include "binary_packet.h"
+#include "float_format.h"
+#include "json_scan.h"
 
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 #include <rapidjson/document.h>
 #include <rapidjson/writer.h>
@@ -10,9 +15,6 @@ using namespace rapidjson;
 
 int remote_env::init()
 {
-	dom_buffer_.resize(dom_default_sz_);
-	stack_buffer_.resize(stack_default_sz_);
-
 	pipe_->create();
 	return 0;
 }
@@ -20,20 +22,60 @@ int remote_env::init()
 int remote_env::wait()
 {
 	pipe_->wait();
+
+	if (expect_hello_)
+		read_hello();
+
 	return 0;
 }
 
-e_start_info remote_env::get_start_info()
+void remote_env::read_hello()
 {
 	char* buf = nullptr;
 	size_t sz = 0;
 
-	packet_type ptype;
-	while (sz == 0)
+	pipe_->receive_wait(reinterpret_cast<void**>(&buf), sz);
+
+	Document doc;
+
+	doc.Parse(buf);
+	if (doc.HasParseError() || !doc.IsObject())
+	{
+		throw std::runtime_error("Hello failed. JSON parse error");
+	}
+
+	if (!doc.HasMember("version") || doc["version"].GetUint() != VERSION)
+	{
+		throw std::runtime_error("Hello failed. Deprecated");
+	}
+
+	if (!doc.HasMember("type") || packet_type(doc["type"].GetInt()) != packet_type::e_hello)
+	{
+		throw std::runtime_error("Hello failed. Unknown packet type");
+	}
+
+	hello_id_ = -1;
+
+	if (!doc.HasMember("hello") || !doc["hello"].IsObject() || !doc["hello"].HasMember("id"))
+		return;
+
+	auto& id = doc["hello"]["id"];
+	if (!id.IsUint() || id.GetUint() > static_cast<unsigned>(INT32_MAX))
 	{
-		pipe_->receive(reinterpret_cast<void**>(&buf), sz);
+		throw std::runtime_error("Hello failed. Invalid env id");
 	}
 
+	hello_id_ = static_cast<int>(id.GetUint());
+}
+
+e_start_info remote_env::get_start_info()
+{
+	char* buf = nullptr;
+	size_t sz = 0;
+
+	packet_type ptype;
+	pipe_->receive_wait(reinterpret_cast<void**>(&buf), sz);
+
 	Document doc;
 
 	doc.Parse(buf);
@@ -64,6 +106,11 @@ e_start_info remote_env::get_start_info()
 	esi.incount = desi["incount"].GetUint64();
 	esi.outcount = desi["outcount"].GetUint64();
 
+	// the binary encoding is only confirmed over transports that can carry it
+	binary_ = desi.HasMember("encoding") && desi["encoding"].IsString() &&
+		strcmp(desi["encoding"].GetString(), "binary") == 0 && pipe_->is_binary_safe() &&
+		!passthrough_;
+
 	state_.mode = esi.mode;
 	state_.count = esi.count;
 	state_.incount = esi.incount;
@@ -98,6 +145,11 @@ int remote_env::set_start_info(const n_start_info& inf)
 	doc.Uint64(inf.count);
 	doc.String("round_seed");
 	doc.Uint64(inf.round_seed);
+	if (binary_)
+	{
+		doc.String("encoding");
+		doc.String("binary");
+	}
 	doc.EndObject();
 	doc.EndObject();
 	s.Put('\0');
@@ -188,10 +240,11 @@ struct e_send_info_parser : public BaseReaderHandler<UTF8<>, e_send_info_parser>
 		{
 		case kExpectEnvDataStartOrEnd:
 			state_ = kExpectEnvDataOrEnd;
+			start_row();
 			return true;
 		case kExpectDataStart:
 			got_payload_ = true;
-			new_data_.reserve(expected_inputs);
+			result->data.reset(0, expected_inputs);
 			result->data.reserve(expected_envs);
 			state_ = kExpectEnvDataStartOrEnd;
 			return true;
@@ -200,6 +253,11 @@ struct e_send_info_parser : public BaseReaderHandler<UTF8<>, e_send_info_parser>
 			lrinfo->result.reserve(expected_envs);
 			got_payload_ = true;
 			state_ = kExpectScoreOrEnd;
+			if (!parse_stream_task(stream, stream_end,
+				[this](double a) { lrinfo->result.push_back(a); return true; }))
+			{
+				lrinfo->result.clear();
+			}
 			return true;
 		default:
 			return false;
@@ -210,9 +268,7 @@ struct e_send_info_parser : public BaseReaderHandler<UTF8<>, e_send_info_parser>
 		switch (state_)
 		{
 		case kExpectEnvDataOrEnd:
-			result->data.emplace_back();
-			result->data.back().swap(new_data_);
-			new_data_.reserve(expected_inputs);
+			result->data.set_valid(row_, column_ != 0);
 			state_ = kExpectEnvDataStartOrEnd;
 			return true;
 		case kExpectEnvDataStartOrEnd:
@@ -231,8 +287,7 @@ struct e_send_info_parser : public BaseReaderHandler<UTF8<>, e_send_info_parser>
 		switch (state_)
 		{
 		case kExpectEnvDataOrEnd:
-			new_data_.emplace_back(a);
-			return true;
+			return push_value(a);
 		case kExpectScoreOrEnd:
 			lrinfo->result.emplace_back(a);
 			return true;
@@ -257,7 +312,7 @@ struct e_send_info_parser : public BaseReaderHandler<UTF8<>, e_send_info_parser>
 			state_ = kExpectPacketNameOrEnd;
 			return true;
 		case kExpectEnvDataStartOrEnd:
-			result->data.emplace_back();
+			result->data.append_row();
 			return (a == 0);
 		default:
 			return Double(static_cast<double>(a));
@@ -282,6 +337,10 @@ struct e_send_info_parser : public BaseReaderHandler<UTF8<>, e_send_info_parser>
 	size_t expected_envs{0};
 	size_t expected_inputs{0};
 
+	// Stream the reader is parsing, enables the bulk parsing of number rows.
+	StringStream* stream{nullptr};
+	const char* stream_end{nullptr};
+
 private:
 	enum State
 	{
@@ -303,27 +362,93 @@ private:
 	bool got_payload_{ false };
 	bool got_head_{ false };
 
-	env_task new_data_;
+	size_t row_{ 0 };
+	size_t column_{ 0 };
+
+	// Rows longer than the input count are rejected.
+	bool push_value(double a)
+	{
+		if (column_ == result->data.width())
+			return false;
+
+		result->data.row(row_)[column_++] = a;
+		return true;
+	}
+
+	void start_row()
+	{
+		row_ = result->data.append_row();
+		column_ = 0;
+
+		if (!parse_stream_task(stream, stream_end, [this](double a) { return push_value(a); }))
+		{
+			std::fill_n(result->data.row(row_), column_, 0.0);
+			column_ = 0;
+		}
+	}
 };
 
-e_send_info remote_env::get()
+bool remote_env::ready()
 {
-	if (last_stack_buffer_sz_ > stack_buffer_.size())
+	if (ready_sz_ == 0)
 	{
-		stack_buffer_.resize(last_stack_buffer_sz_);
+		pipe_->receive(reinterpret_cast<void**>(&ready_buf_), ready_sz_);
 	}
 
-	char* buf = nullptr;
-	size_t sz = 0;
+	return ready_sz_ != 0;
+}
+
+void remote_env::on_ready(std::function<void()> handler)
+{
+	pipe_->on_readable(std::move(handler));
+}
 
-	while (sz == 0)
+int remote_env::get(e_send_info& esi)
+{
+	while (!ready())
 	{
-		pipe_->receive(reinterpret_cast<void**>(&buf), sz);
+		pipe_->wait_readable();
 	}
 
-	e_send_info esi;
+	return decode(esi);
+}
+
+int remote_env::decode(e_send_info& esi)
+{
+	if (ready_sz_ == 0)
+		throw std::logic_error("remote_env::decode called before the packet was received");
 
-	MemoryPoolAllocator<> stack_allocator{ stack_buffer_.data(), stack_buffer_.size() };
+	stack_buffer_.reserve(std::max(last_stack_buffer_sz_, stack_default_sz_));
+
+	char* buf = ready_buf_;
+	size_t sz = ready_sz_;
+	ready_buf_ = nullptr;
+	ready_sz_ = 0;
+
+	esi.head = verification_header::fail;
+	esi.data.clear();
+	esi.raw.clear();
+
+	if (binary_ && is_binary_packet(buf, sz))
+	{
+		read_binary(buf, sz, esi);
+
+		lasthead_ = esi.head;
+		if (esi.head != verification_header::ok)
+		{
+			esi.data.clear();
+		}
+
+		return 0;
+	}
+
+	if (passthrough_ && read_raw(buf, sz, esi))
+	{
+		lasthead_ = esi.head;
+		return 0;
+	}
+
+	MemoryPoolAllocator<> stack_allocator{ stack_buffer_.data(), stack_buffer_.capacity() };
 
 	GenericReader<UTF8<>, UTF8<>, MemoryPoolAllocator<>> reader(&stack_allocator,
 		stack_buffer_.capacity());
@@ -334,6 +459,8 @@ e_send_info remote_env::get()
 	handler.expected_inputs = state_.incount;
 	handler.result = &esi;
 	handler.lrinfo = &lrinfo_;
+	handler.stream = &ss;
+	handler.stream_end = buf + sz;
 
 	reader.Parse(ss, handler);
 
@@ -355,24 +482,144 @@ e_send_info remote_env::get()
 
 	last_stack_buffer_sz_ = stack_allocator.Size();
 
-	return esi;
+	return 0;
 }
 
-int remote_env::set(const n_send_info& inf)
+void remote_env::read_binary(const char* buf, size_t sz, e_send_info& esi)
 {
-	if (last_dom_buffer_sz_ > dom_buffer_.size())
+	auto hdr = read_binary_header(buf, sz);
+
+	if (packet_type(hdr.type) != packet_type::e_send_info)
 	{
-		dom_buffer_.resize(last_dom_buffer_sz_);
+		throw std::runtime_error("Get failed. Unknown packet type");
 	}
 
-	if (last_stack_buffer_sz_ > stack_buffer_.size())
+	esi.head = verification_header(hdr.head);
+
+	// the shape is checked before anything is sized from it
+	size_t width = esi.head == verification_header::restart ? 1 : state_.incount;
+	if (hdr.count > state_.count || (hdr.count != 0 && hdr.width != width))
 	{
-		stack_buffer_.resize(last_stack_buffer_sz_);
+		throw std::runtime_error("Get failed. Binary packet shape doesn't match the start info");
 	}
 
+	const char* values = buf + binary_header_size;
+
+	if (esi.head == verification_header::restart)
+	{
+		lrinfo_.result.resize(static_cast<size_t>(hdr.count) * hdr.width);
+		read_doubles(lrinfo_.result.data(), values, lrinfo_.result.size());
+		return;
+	}
+
+	esi.data.reset(hdr.count, hdr.width);
+	esi.data.set_all_valid();
+	read_doubles(esi.data.data(), values, static_cast<size_t>(hdr.count) * hdr.width);
+}
+
+bool remote_env::read_raw(const char* buf, size_t sz, e_send_info& esi)
+{
+	static const std::string type_text = std::to_string(static_cast<int>(packet_type::e_send_info));
+	static const char null_row[] = "null";
+
+	json_member members[] = { { "type" }, { "head" }, { "data" } };
+	json_scan_members(buf, buf + sz, members, 3);
+
+	auto& type = members[0];
+	auto& head = members[1];
+	auto& data = members[2];
+
+	// packets without observations, e.g. with restart scores, take the regular path
+	if (!type.begin || !head.begin || !data.begin || *data.begin != '[' ||
+		!json_equals(head.begin, head.end, "0"))
+	{
+		return false;
+	}
+
+	if (!json_equals(type.begin, type.end, type_text.c_str()))
+	{
+		throw std::runtime_error("Get failed. Unknown packet type");
+	}
+
+	esi.head = verification_header::ok;
+	esi.raw.clear();
+
+	json_for_each_element(data.begin, data.end, [&](const char* begin, const char* end)
+	{
+		if (esi.raw.count() == state_.count)
+			return;
+
+		if (*begin == '[')
+			esi.raw.append(begin, end);
+		else
+			esi.raw.append(null_row, null_row + 4);
+	});
+
+	while (esi.raw.count() < state_.count)
+	{
+		esi.raw.append(null_row, null_row + 4);
+	}
+
+	return true;
+}
+
+void remote_env::write_binary(const n_send_view& inf)
+{
+	size_t width = inf.data.empty() ? state_.outcount : inf.data.width();
+	size_t sz = binary_packet_size(inf.data.rows(), width);
+
+	dom_buffer_.reserve(sz);
+
+	binary_header hdr;
+	hdr.type = static_cast<std::uint16_t>(packet_type::n_send_info);
+	hdr.head = static_cast<std::uint16_t>(inf.head);
+	hdr.count = static_cast<std::uint32_t>(inf.data.rows());
+	hdr.width = static_cast<std::uint32_t>(width);
+	write_binary_header(dom_buffer_.data(), hdr);
+
+	char* values = dom_buffer_.data() + binary_header_size;
+	if (!inf.data.empty())
+	{
+		write_doubles(values, inf.data.data(), inf.data.rows() * width);
+		values += inf.data.rows() * width * sizeof(double);
+	}
+
+	*values = '\0';
+
+	encoded_data_ = dom_buffer_.data();
+	encoded_sz_ = sz;
+}
+
+int remote_env::set(const n_send_view& inf)
+{
+	encode(inf);
+	send_encoded();
+
+	return 0;
+}
+
+void remote_env::send_encoded()
+{
+	pipe_->send(encoded_data_, encoded_sz_);
+	encoded_data_ = nullptr;
+	encoded_sz_ = 0;
+}
+
+void remote_env::encode(const n_send_view& inf)
+{
+	if (binary_ && inf.head == verification_header::ok)
+	{
+		write_binary(inf);
+		return;
+	}
+
+	dom_buffer_.reserve(std::max(last_dom_buffer_sz_, dom_default_sz_));
+
+	stack_buffer_.reserve(std::max(last_stack_buffer_sz_, stack_default_sz_));
+
 	using StringBufferType = GenericStringBuffer<UTF8<>, MemoryPoolAllocator<>>;
-	MemoryPoolAllocator<> dom_allocator{ dom_buffer_.data(), dom_buffer_.size() };
-	MemoryPoolAllocator<> stack_allocator{ stack_buffer_.data(), stack_buffer_.size() };
+	MemoryPoolAllocator<> dom_allocator{ dom_buffer_.data(), dom_buffer_.capacity() };
+	MemoryPoolAllocator<> stack_allocator{ stack_buffer_.data(), stack_buffer_.capacity() };
 
 	StringBufferType s{ &dom_allocator, dom_allocator.Capacity() };
 	Writer< StringBufferType, UTF8<>, UTF8<>, MemoryPoolAllocator<> > doc(s, &stack_allocator);
@@ -384,34 +631,45 @@ int remote_env::set(const n_send_info& inf)
 	doc.String("head");
 	doc.Int(static_cast<int>(inf.head));
 
-	if (inf.head == verification_header::ok)
+	if (inf.head == verification_header::ok && passthrough_)
 	{
 		doc.String("data");
 		doc.StartArray();
-		for (auto& i : inf.data)
+		for (size_t i = 0; i < inf.raw.count(); i++)
 		{
-			doc.StartArray();
-			for (auto& j : i)
-			{
-				doc.Double(j);
-			}
-
-			doc.EndArray();
+			doc.RawValue(inf.raw.row_data(i), inf.raw.row_size(i), kArrayType);
 		}
 
 		doc.EndArray();
 	}
+	else if (inf.head == verification_header::ok)
+	{
+		doc.String("data");
+		write_tasks(doc, s, inf.data, float_digits_, false);
+	}
 
 	doc.EndObject();
 	doc.EndObject();
 	s.Put('\0');
 
-	pipe_->send(s.GetString(), s.GetSize());
+	// Text that outgrew dom_buffer_ lives in the allocator's own chunks,
+	// which go away with it, so it is kept in spill_buffer_ until sent.
+	const char* text = s.GetString();
+	encoded_sz_ = s.GetSize();
+
+	if (text >= dom_buffer_.data() && text + encoded_sz_ <= dom_buffer_.data() + dom_buffer_.capacity())
+	{
+		encoded_data_ = text;
+	}
+	else
+	{
+		spill_buffer_.reserve(encoded_sz_);
+		std::memcpy(spill_buffer_.data(), text, encoded_sz_);
+		encoded_data_ = spill_buffer_.data();
+	}
 
 	last_dom_buffer_sz_ = dom_allocator.Size();
 	last_stack_buffer_sz_ = stack_allocator.Size();
-
-	return 0;
 }
 
 int remote_env::restart(const n_restart_info& inf)
@@ -419,8 +677,16 @@ int remote_env::restart(const n_restart_info& inf)
 	state_.count = inf.count;
 	state_.round_seed = inf.round_seed;
 
-	StringBuffer s;
-	Writer< StringBuffer > doc(s);
+	dom_buffer_.reserve(std::max(last_dom_buffer_sz_, dom_default_sz_));
+
+	stack_buffer_.reserve(std::max(last_stack_buffer_sz_, stack_default_sz_));
+
+	using StringBufferType = GenericStringBuffer<UTF8<>, MemoryPoolAllocator<>>;
+	MemoryPoolAllocator<> dom_allocator{ dom_buffer_.data(), dom_buffer_.capacity() };
+	MemoryPoolAllocator<> stack_allocator{ stack_buffer_.data(), stack_buffer_.capacity() };
+
+	StringBufferType s{ &dom_allocator, dom_allocator.Capacity() };
+	Writer< StringBufferType, UTF8<>, UTF8<>, MemoryPoolAllocator<> > doc(s, &stack_allocator);
 	doc.StartObject();
 	doc.String("type");
 	doc.Int(static_cast<int>(packet_type::n_send_info));
@@ -438,6 +704,9 @@ int remote_env::restart(const n_restart_info& inf)
 
 	pipe_->send(s.GetString(), s.GetSize());
 
+	last_dom_buffer_sz_ = dom_allocator.Size();
+	last_stack_buffer_sz_ = stack_allocator.Size();
+
 	return 0;
 }
 
@@ -466,12 +735,13 @@ int remote_env::terminate()
 {
 	pipe_->close();
 
-	dom_buffer_.resize(dom_default_sz_);
-	dom_buffer_.shrink_to_fit();
+	ready_buf_ = nullptr;
+	ready_sz_ = 0;
+
+	dom_buffer_.reset();
 	last_dom_buffer_sz_ = 0;
 
-	stack_buffer_.resize(stack_default_sz_);
-	stack_buffer_.shrink_to_fit();
+	stack_buffer_.reset();
 	last_stack_buffer_sz_ = 0;
 
 	return 0;
@@ -2,11 +2,20 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <functional>
 #include <memory>
 #include <vector>
 
+#include "buffer_pool.h"
 #include "env.h"
 
+// A piece of a packet passed to base_stream::send_gather.
+struct send_buffer
+{
+	const void* data;
+	std::size_t size;
+};
+
 class base_stream
 {
 public:
@@ -14,8 +23,32 @@ public:
 	virtual ~base_stream() = default;
 	virtual void receive(void** ppd, std::size_t& sz) = 0;
 	virtual void send(const void* pd, std::size_t sz) = 0;
+
+	// Sends the buffers one after another as a single packet, written from
+	// where they are. Unlike send, the payload has no trailing '\0': the
+	// stream adds it when its framing needs one.
+	virtual void send_gather(const send_buffer* bufs, std::size_t count) = 0;
 	virtual bool is_connected() const = 0;
 
+	// Whether packets may contain '\0' bytes, i.e. aren't delimited by them.
+	virtual bool is_binary_safe() const
+	{
+		return false;
+	}
+
+	virtual void on_readable(std::function<void()> handler) = 0;
+	virtual void wait_readable() = 0;
+
+	void receive_wait(void** ppd, std::size_t& sz)
+	{
+		receive(ppd, sz);
+		while (sz == 0)
+		{
+			wait_readable();
+			receive(ppd, sz);
+		}
+	}
+
 	virtual void connect() = 0;
 	virtual void disconnect() = 0;
 
@@ -24,6 +57,15 @@ public:
 	virtual void close() = 0;
 };
 
+class base_listener
+{
+public:
+
+	virtual ~base_listener() = default;
+	virtual void create() = 0;
+	virtual void close() = 0;
+};
+
 enum class packet_type
 {
 	none = 0,
@@ -32,7 +74,8 @@ enum class packet_type
 	n_send_info,
 	e_send_info,
 	n_restart_info,
-	e_restart_info
+	e_restart_info,
+	e_hello
 };
 
 class remote_env : public base_env
@@ -42,27 +85,47 @@ class remote_env : public base_env
 	env_state state_;
 	e_restart_info lrinfo_;
 
-	static const size_t dom_default_sz_ = 64 * 1024u;
-	static const size_t stack_default_sz_ = 4 * 1024u;
+	static constexpr size_t dom_default_sz_ = 64 * 1024u;
+	static constexpr size_t stack_default_sz_ = 4 * 1024u;
 
 	size_t last_dom_buffer_sz_{};
 	size_t last_stack_buffer_sz_{};
 
-	std::vector<std::uint8_t> dom_buffer_;
-	std::vector<std::uint8_t> stack_buffer_;
+	pooled_buffer dom_buffer_;
+	pooled_buffer stack_buffer_;
+	pooled_buffer spill_buffer_;
+
+	const char* encoded_data_{ nullptr };
+	size_t encoded_sz_{};
+
+	char* ready_buf_{ nullptr };
+	size_t ready_sz_{};
+
+	bool binary_{ false };
+	bool passthrough_{ false };
+	int float_digits_{ 0 };
+	bool expect_hello_{ false };
+	int hello_id_{ -1 };
+
+	void read_hello();
+	void read_binary(const char* buf, size_t sz, e_send_info& esi);
+	bool read_raw(const char* buf, size_t sz, e_send_info& esi);
+	void write_binary(const n_send_view& inf);
 
 public:
 
 	static const unsigned VERSION = 0x00000100;
 
 	int init() override;
-	int wait();
+	int wait() override;
 
 	e_start_info get_start_info() override;
 	int set_start_info(const n_start_info& inf) override;
 
-	e_send_info get() override;
-	int set(const n_send_info& inf) override;
+	bool ready() override;
+	void on_ready(std::function<void()> handler) override;
+	int get(e_send_info& esi) override;
+	int set(const n_send_view& inf) override;
 	int restart(const n_restart_info& inf) override;
 
 	int stop() override;
@@ -73,7 +136,7 @@ public:
 		return lasthead_;
 	}
 
-	e_restart_info get_restart_info() const override
+	const e_restart_info& get_restart_info() const override
 	{
 		return lrinfo_;
 	}
@@ -83,8 +146,40 @@ public:
 		return state_;
 	}
 
-	explicit remote_env(std::unique_ptr<base_stream>&& a) :
-		pipe_(std::move(a)), lasthead_(), state_(), lrinfo_()
+	// Data rows are forwarded as JSON text in e_send_info::raw / n_send_info::raw.
+	void set_passthrough(bool passthrough)
+	{
+		passthrough_ = passthrough;
+	}
+
+	// Significant digits of the written actions, 0 for the shortest exact text.
+	void set_float_digits(int digits)
+	{
+		float_digits_ = digits;
+	}
+
+	// get and set in halves, so that the parsing and serializing can run on a
+	// codec thread while the loop thread does the socket work: decode parses
+	// the packet that ready() took, encode leaves the packet for send_encoded.
+	// Neither half touches the stream.
+	int decode(e_send_info& esi);
+	void encode(const n_send_view& inf);
+	void send_encoded();
+
+	// The peer announces itself with an e_hello packet right after connecting.
+	void expect_hello()
+	{
+		expect_hello_ = true;
+	}
+
+	// Env index from the last hello, or -1 if the peer didn't claim one.
+	int get_hello_id() const
+	{
+		return hello_id_;
+	}
+
+	remote_env(std::unique_ptr<base_stream>&& a, buffer_pool& pool) :
+		pipe_(std::move(a)), lasthead_(), state_(), lrinfo_(), dom_buffer_(pool), stack_buffer_(pool), spill_buffer_(pool)
 	{
 	}
 
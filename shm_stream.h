@@ -0,0 +1,560 @@
+#pragma once
+
+#include "event_loop.h"
+#include "remote_env.h"
+#include "uri.h"
+
+#if defined(ASIO_HAS_POSIX_STREAM_DESCRIPTOR)
+
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Shared memory transport. The region at "<path>.shm" holds two single
+// producer/single consumer rings: "up" carries env -> multiplexer packets,
+// "down" carries multiplexer -> env packets. Each ring has a FIFO doorbell
+// ("<path>.up", "<path>.down") that the producer writes one byte to after
+// publishing a packet, so the consumer can sleep in the event loop. A producer
+// that finds its ring full sets space_wanted and sleeps on its own incoming
+// doorbell; the consumer clears the flag and rings back once it has released
+// a record.
+//
+// Each side opens its incoming doorbell read-only and its outgoing one
+// write-only, so a peer that exits, cleanly or not, leaves the reader at EOF
+// and the stream fails like a socket does.
+//
+// Ring records are a 8-byte length followed by the payload padded to 8 bytes.
+// A length of shm_wrap_marker means the producer skipped to the ring start.
+// receive() returns a pointer into the mapping; the record is released on the
+// next receive() call.
+
+struct shm_ring_header
+{
+	std::atomic<std::uint64_t> head;
+	char head_pad[56];
+	std::atomic<std::uint64_t> tail;
+	std::atomic<std::uint32_t> space_wanted;
+	char tail_pad[52];
+};
+
+struct shm_region_header
+{
+	std::uint32_t magic;
+	std::uint32_t version;
+	std::uint64_t ring_size;
+	std::atomic<std::uint32_t> connected;
+	char pad[44];
+	shm_ring_header up;
+	shm_ring_header down;
+};
+
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free,
+	"shm transport requires lock-free 64-bit atomics");
+static_assert(sizeof(shm_region_header) % 64 == 0, "shm header must keep rings aligned");
+
+class shm_stream : public base_stream
+{
+	using descriptor = asio::posix::stream_descriptor;
+
+	static constexpr std::uint32_t shm_magic = 0x564e454d;
+	static constexpr std::uint32_t shm_version = 2;
+	static constexpr std::uint64_t shm_wrap_marker = ~std::uint64_t(0);
+
+	event_loop& loop_;
+	std::string path_;
+	std::size_t ring_size_;
+	bool server_{ false };
+
+	void* region_{ nullptr };
+	std::size_t region_size_{ 0 };
+
+	descriptor in_bell_;
+	descriptor out_bell_;
+	handler_memory wait_memory_;
+
+	shm_ring_header* in_{ nullptr };
+	shm_ring_header* out_{ nullptr };
+	char* in_data_{ nullptr };
+	char* out_data_{ nullptr };
+
+	std::uint64_t release_pos_{ 0 };
+	bool has_release_{ false };
+
+	shm_region_header* header() const
+	{
+		return static_cast<shm_region_header*>(region_);
+	}
+
+	void map(int fd, bool init);
+	void open_in_bell();
+	void open_out_bell();
+	void unmap();
+	bool available() const;
+	void ring(descriptor& bell);
+	bool drain(descriptor& bell, bool& closed);
+	void release();
+	void wait_space(std::uint64_t head, std::uint64_t need);
+	void write_record(const send_buffer* bufs, std::size_t count, std::size_t nul);
+
+public:
+	static constexpr std::size_t default_ring_size = 3072000;
+
+	// Ring size of the regions this side creates, from shm://path?ring=64M.
+	static std::size_t ring_size(const connection_uri& uri);
+
+	shm_stream(event_loop& loop, std::string path, std::size_t ring_size);
+	shm_stream(const shm_stream&) = delete;
+
+	shm_stream& operator =(const shm_stream& a) = delete;
+	~shm_stream();
+	void receive(void** ppd, std::size_t& sz) override;
+	void send(const void* pd, std::size_t sz) override;
+	void send_gather(const send_buffer* bufs, std::size_t count) override;
+	bool is_connected() const override;
+
+	bool is_binary_safe() const override
+	{
+		return true;
+	}
+
+	void on_readable(std::function<void()> handler) override;
+	void wait_readable() override;
+	void connect() override;
+	void disconnect() override;
+
+	void create() override;
+	void wait() override;
+	void close() override;
+};
+
+inline shm_stream::shm_stream(event_loop& loop, std::string path, std::size_t ring_size)
+	: loop_(loop), path_(path), ring_size_((ring_size + 7) & ~std::size_t(7)),
+	in_bell_(loop.service()), out_bell_(loop.service())
+{
+}
+
+inline std::size_t shm_stream::ring_size(const connection_uri& uri)
+{
+	std::size_t res = static_cast<std::size_t>(parse_size_param("ring", uri.param("ring")));
+	if (res == 0)
+		return default_ring_size;
+	if (res < 4096)
+		throw std::invalid_argument("shm ring size must be at least 4K");
+	return res;
+}
+
+inline shm_stream::~shm_stream()
+{
+	close();
+}
+
+inline void shm_stream::map(int fd, bool init)
+{
+	region_size_ = sizeof(shm_region_header) + 2 * ring_size_;
+
+	if (init && ftruncate(fd, static_cast<off_t>(region_size_)) != 0)
+	{
+		::close(fd);
+		throw std::runtime_error("shm error: couldn't resize " + path_ + ".shm");
+	}
+
+	if (!init)
+	{
+		struct stat st;
+		if (fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(shm_region_header))
+		{
+			::close(fd);
+			throw std::runtime_error("shm error: invalid region " + path_ + ".shm");
+		}
+		region_size_ = static_cast<std::size_t>(st.st_size);
+	}
+
+	region_ = mmap(nullptr, region_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+
+	if (region_ == MAP_FAILED)
+	{
+		region_ = nullptr;
+		throw std::runtime_error("shm error: couldn't map " + path_ + ".shm");
+	}
+
+	auto hdr = header();
+
+	if (init)
+	{
+		hdr->ring_size = ring_size_;
+		hdr->version = shm_version;
+		hdr->connected.store(0);
+		hdr->up.head.store(0);
+		hdr->up.tail.store(0);
+		hdr->up.space_wanted.store(0);
+		hdr->down.head.store(0);
+		hdr->down.tail.store(0);
+		hdr->down.space_wanted.store(0);
+		hdr->magic = shm_magic;
+	}
+	else if (hdr->magic != shm_magic || hdr->version != shm_version ||
+		sizeof(shm_region_header) + 2 * hdr->ring_size > region_size_)
+	{
+		unmap();
+		throw std::runtime_error("shm error: incompatible region " + path_ + ".shm");
+	}
+
+	ring_size_ = hdr->ring_size;
+
+	auto up_data = static_cast<char*>(region_) + sizeof(shm_region_header);
+	auto down_data = up_data + ring_size_;
+
+	in_ = server_ ? &hdr->up : &hdr->down;
+	out_ = server_ ? &hdr->down : &hdr->up;
+	in_data_ = server_ ? up_data : down_data;
+	out_data_ = server_ ? down_data : up_data;
+
+	has_release_ = false;
+}
+
+inline void shm_stream::open_in_bell()
+{
+	std::string in_path = path_ + (server_ ? ".up" : ".down");
+
+	int in_fd = ::open(in_path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (in_fd < 0)
+		throw std::runtime_error("shm error: couldn't open doorbell " + in_path);
+	in_bell_.assign(in_fd);
+}
+
+// Fails with ENXIO until the peer has opened the doorbell for reading.
+inline void shm_stream::open_out_bell()
+{
+	std::string out_path = path_ + (server_ ? ".down" : ".up");
+
+	// ringing a peer that exited has to fail with EPIPE, not kill the process
+	std::signal(SIGPIPE, SIG_IGN);
+
+	int out_fd = ::open(out_path.c_str(), O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+	if (out_fd < 0)
+		throw std::runtime_error("shm error: couldn't open doorbell " + out_path);
+	out_bell_.assign(out_fd);
+}
+
+inline void shm_stream::unmap()
+{
+	if (region_)
+		munmap(region_, region_size_);
+
+	region_ = nullptr;
+	in_ = out_ = nullptr;
+	in_data_ = out_data_ = nullptr;
+	has_release_ = false;
+}
+
+inline bool shm_stream::available() const
+{
+	return in_ && in_->head.load(std::memory_order_acquire) !=
+		(has_release_ ? release_pos_ : in_->tail.load(std::memory_order_relaxed));
+}
+
+inline void shm_stream::ring(descriptor& bell)
+{
+	char b = 0;
+	// a full FIFO already wakes the consumer, so EAGAIN is fine here
+	if (::write(bell.native_handle(), &b, 1) < 0 && errno != EAGAIN)
+	{
+		if (errno == EPIPE)
+			throw std::runtime_error("shm error: peer closed the connection");
+		throw std::runtime_error("shm error: doorbell write failed");
+	}
+}
+
+// Empties the doorbell; closed is set once the peer has closed its end.
+inline bool shm_stream::drain(descriptor& bell, bool& closed)
+{
+	char b[256];
+	bool drained = false;
+
+	while (true)
+	{
+		ssize_t n = ::read(bell.native_handle(), b, sizeof(b));
+		if (n > 0)
+		{
+			drained = true;
+			continue;
+		}
+
+		closed = closed || n == 0;
+		return drained;
+	}
+}
+
+inline void shm_stream::release()
+{
+	in_->tail.store(release_pos_, std::memory_order_release);
+	has_release_ = false;
+
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (in_->space_wanted.load(std::memory_order_relaxed) != 0 && in_->space_wanted.exchange(0) != 0)
+		ring(out_bell_);
+}
+
+inline void shm_stream::receive(void** ppd, std::size_t& sz)
+{
+	sz = 0;
+
+	if (!in_)
+		throw std::runtime_error("shm error: not connected");
+
+	if (has_release_)
+		release();
+
+	std::uint64_t tail = in_->tail.load(std::memory_order_relaxed);
+	std::uint64_t head = in_->head.load(std::memory_order_acquire);
+
+	if (head == tail)
+	{
+		bool closed = false;
+		drain(in_bell_, closed);
+		head = in_->head.load(std::memory_order_acquire);
+		if (head == tail)
+		{
+			if (closed)
+				throw std::runtime_error("shm error: peer closed the connection");
+			return;
+		}
+	}
+
+	std::uint64_t len;
+	std::memcpy(&len, in_data_ + tail % ring_size_, sizeof(len));
+
+	if (len == shm_wrap_marker)
+	{
+		tail += ring_size_ - tail % ring_size_;
+		std::memcpy(&len, in_data_, sizeof(len));
+	}
+
+	// the record has to end before the ring's end and the published head
+	std::uint64_t offset = tail % ring_size_;
+	std::uint64_t published = head - tail;
+	if (published > ring_size_ || published < sizeof(len) ||
+		len > ring_size_ - offset - sizeof(len) ||
+		((len + 7) & ~std::uint64_t(7)) > published - sizeof(len))
+		throw std::runtime_error("shm error: corrupted ring record");
+
+	*ppd = in_data_ + offset + sizeof(len);
+	sz = static_cast<std::size_t>(len);
+
+	release_pos_ = tail + sizeof(len) + ((len + 7) & ~std::uint64_t(7));
+	has_release_ = true;
+}
+
+inline void shm_stream::send(const void* pd, std::size_t sz)
+{
+	send_buffer buf{ pd, sz };
+	write_record(&buf, 1, 0);
+}
+
+// Records keep the '\0' that ends send's packets, so the gathered ones get
+// it appended.
+inline void shm_stream::send_gather(const send_buffer* bufs, std::size_t count)
+{
+	write_record(bufs, count, 1);
+}
+
+// Blocks until the consumer has released enough of the ring. The consumer
+// rings our incoming doorbell, so bytes drained from it meanwhile may belong
+// to packets; a pending on_readable is woken afterwards to look for them.
+inline void shm_stream::wait_space(std::uint64_t head, std::uint64_t need)
+{
+	bool drained = false;
+	bool closed = false;
+
+	while (true)
+	{
+		out_->space_wanted.store(1);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		if (ring_size_ - (head - out_->tail.load(std::memory_order_acquire)) >= need)
+			break;
+
+		if (closed || header()->connected.load() == 0)
+			throw std::runtime_error("shm error: peer disconnected with a full ring");
+
+		pollfd pfd{ in_bell_.native_handle(), POLLIN, 0 };
+		if (::poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			throw std::runtime_error("shm error: doorbell wait failed");
+
+		drained = drain(in_bell_, closed) || drained;
+	}
+
+	out_->space_wanted.store(0, std::memory_order_relaxed);
+
+	// completes a pending wait with operation_aborted, which on_readable's
+	// handler takes as readable
+	if (drained)
+		in_bell_.cancel();
+}
+
+inline void shm_stream::write_record(const send_buffer* bufs, std::size_t count, std::size_t nul)
+{
+	if (!out_)
+		throw std::runtime_error("shm error: not connected");
+
+	std::size_t sz = nul;
+	for (std::size_t i = 0; i < count; i++)
+		sz += bufs[i].size;
+
+	std::uint64_t len = sz;
+	std::uint64_t need = sizeof(len) + ((len + 7) & ~std::uint64_t(7));
+
+	if (need > ring_size_)
+		throw std::runtime_error("shm error: packet exceeds ring size");
+
+	std::uint64_t head = out_->head.load(std::memory_order_relaxed);
+	std::uint64_t skip = ring_size_ - head % ring_size_;
+	if (skip >= need)
+		skip = 0;
+
+	if (ring_size_ - (head - out_->tail.load(std::memory_order_acquire)) < skip + need)
+		wait_space(head, skip + need);
+
+	if (skip != 0)
+	{
+		std::memcpy(out_data_ + head % ring_size_, &shm_wrap_marker, sizeof(shm_wrap_marker));
+		head += skip;
+	}
+
+	char* rec = out_data_ + head % ring_size_;
+	std::memcpy(rec, &len, sizeof(len));
+
+	char* p = rec + sizeof(len);
+	for (std::size_t i = 0; i < count; i++)
+	{
+		if (bufs[i].size != 0)
+			std::memcpy(p, bufs[i].data, bufs[i].size);
+		p += bufs[i].size;
+	}
+
+	if (nul != 0)
+		*p = '\0';
+
+	out_->head.store(head + need, std::memory_order_release);
+	ring(out_bell_);
+}
+
+inline bool shm_stream::is_connected() const
+{
+	return region_ != nullptr && header()->connected.load() != 0;
+}
+
+inline void shm_stream::on_readable(std::function<void()> handler)
+{
+	if (available())
+	{
+		asio::post(loop_.service(), bind_memory(wait_memory_, std::move(handler)));
+		return;
+	}
+
+	in_bell_.async_wait(descriptor::wait_read, bind_memory(wait_memory_,
+		[handler = std::move(handler)](const asio::error_code&) { handler(); }));
+}
+
+inline void shm_stream::wait_readable()
+{
+	bool readable = false;
+	on_readable([&readable]() { readable = true; });
+	loop_.run_until([&readable]() { return readable; });
+}
+
+inline void shm_stream::connect()
+{
+	close();
+	server_ = false;
+
+	int fd = ::open((path_ + ".shm").c_str(), O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		throw std::runtime_error("shm error: couldn't open " + path_ + ".shm");
+
+	map(fd, false);
+	open_in_bell();
+	open_out_bell();
+
+	header()->connected.store(1);
+	ring(out_bell_);
+}
+
+inline void shm_stream::disconnect()
+{
+	if (region_)
+		header()->connected.store(0);
+
+	if (in_bell_.is_open())
+		in_bell_.close();
+	if (out_bell_.is_open())
+		out_bell_.close();
+
+	unmap();
+}
+
+inline void shm_stream::create()
+{
+	close();
+	server_ = true;
+
+	if (path_.empty())
+		throw std::invalid_argument("shm error: empty region path");
+
+	for (auto suffix : { ".up", ".down" })
+	{
+		std::string bell = path_ + suffix;
+		std::remove(bell.c_str());
+		if (mkfifo(bell.c_str(), 0600) != 0)
+			throw std::runtime_error("shm error: couldn't create doorbell " + bell);
+	}
+
+	int fd = ::open((path_ + ".shm").c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		throw std::runtime_error("shm error: couldn't create " + path_ + ".shm");
+
+	map(fd, true);
+	open_in_bell();
+}
+
+inline void shm_stream::wait()
+{
+	if (!server_)
+		return;
+
+	bool closed = false;
+	while (header()->connected.load() == 0)
+	{
+		wait_readable();
+		drain(in_bell_, closed);
+
+		if (closed && header()->connected.load() == 0)
+			throw std::runtime_error("shm error: peer closed the connection before connecting");
+	}
+
+	open_out_bell();
+}
+
+inline void shm_stream::close()
+{
+	disconnect();
+
+	if (server_)
+	{
+		std::remove((path_ + ".shm").c_str());
+		std::remove((path_ + ".up").c_str());
+		std::remove((path_ + ".down").c_str());
+		server_ = false;
+	}
+}
+
+#endif
@@ -0,0 +1,448 @@
+#pragma once
+
+#include "buffer_pool.h"
+#include "event_loop.h"
+#include "framing.h"
+#include "remote_env.h"
+#include "uri.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+template <class Acceptor, class Socket>
+inline void accept_socket(event_loop& loop, Acceptor& acceptor, Socket& sock)
+{
+	asio::error_code ec;
+	bool accepted = false;
+	sock = Socket(loop.service());
+
+	acceptor.async_accept(sock, [&ec, &accepted](const asio::error_code& e)
+	{
+		ec = e;
+		accepted = true;
+	});
+
+	loop.run_until([&accepted]() { return accepted; });
+
+	if (ec != asio::error_code())
+	{
+		asio::detail::throw_error(ec, "accept");
+	}
+}
+
+// Listening socket shared by several streams. Every stream wait() takes the
+// next pending connection, so peers are matched to streams in arrival order.
+template <class Protocol>
+class socket_listener : public base_listener
+{
+protected:
+	event_loop& loop_;
+	typename Protocol::acceptor acceptor_;
+
+public:
+	explicit socket_listener(event_loop& loop)
+		: loop_(loop), acceptor_(loop.service())
+	{
+	}
+
+	void accept(typename Protocol::socket& sock)
+	{
+		if (!acceptor_.is_open())
+			throw std::runtime_error("listener error: not listening");
+
+		accept_socket(loop_, acceptor_, sock);
+	}
+
+	void close() override
+	{
+		if (acceptor_.is_open())
+			acceptor_.close();
+	}
+};
+
+template <class Protocol>
+class socket_stream : public base_stream
+{
+protected:
+	using socket_type = typename Protocol::socket;
+	using acceptor_type = typename Protocol::acceptor;
+
+	event_loop& loop_;
+	socket_type sock_;
+	acceptor_type acceptor_;
+	socket_listener<Protocol>* listener_{ nullptr };
+	pooled_buffer buf_;
+	framing_mode framing_;
+	bool server_;
+	size_t received_{ 0 };
+	size_t consumed_{ 0 };
+	size_t expected_{ 0 };
+	size_t max_frame_size_{ default_max_frame_size };
+	unsigned char header_[frame_header_size];
+	unsigned char header_out_[frame_header_size];
+	size_t static const min_read_size = 16384;
+	handler_memory wait_memory_;
+	std::vector<asio::const_buffer> out_bufs_;
+	char nul_{ '\0' };
+	// the rest of a packet the socket didn't take at once, written by async_write
+	pooled_buffer out_rest_;
+	bool writing_{ false };
+	asio::error_code write_error_;
+	handler_memory write_memory_;
+
+	void on_connected();
+	virtual void on_socket_connected() {}
+	virtual void on_socket_read(size_t sz) {}
+
+	bool receive_nul(size_t& sz);
+	bool receive_length(size_t& sz);
+	void write_all();
+	void wait_write();
+
+public:
+	socket_stream(event_loop& loop, buffer_pool& pool, framing_mode framing);
+	socket_stream(const socket_stream&) = delete;
+
+	socket_stream& operator =(const socket_stream& a) = delete;
+
+	void share_listener(socket_listener<Protocol>& listener)
+	{
+		listener_ = &listener;
+	}
+
+	// Largest length-framed packet accepted, from tcp://host:port?max_frame=1G.
+	static size_t max_frame_size(const connection_uri& uri)
+	{
+		size_t res = static_cast<size_t>(parse_size_param("max_frame", uri.param("max_frame")));
+		return res == 0 ? default_max_frame_size : res;
+	}
+
+	void set_max_frame_size(size_t max_size)
+	{
+		max_frame_size_ = max_size;
+	}
+
+	void receive(void** ppd, size_t& sz) override;
+	void send(const void* pd, size_t sz) override;
+	void send_gather(const send_buffer* bufs, size_t count) override;
+	bool is_connected() const override;
+
+	bool is_binary_safe() const override
+	{
+		return framing_ == framing_mode::length;
+	}
+
+	void on_readable(std::function<void()> handler) override;
+	void wait_readable() override;
+
+	void wait() override;
+	void disconnect() override;
+	void close() override;
+};
+
+template <class Protocol>
+inline socket_stream<Protocol>::socket_stream(event_loop& loop, buffer_pool& pool, framing_mode framing)
+	: loop_(loop), sock_(loop.service()), acceptor_(loop.service()), buf_(pool),
+	framing_(framing), server_(false), out_rest_(pool)
+{
+}
+
+template <class Protocol>
+inline void socket_stream<Protocol>::on_connected()
+{
+	sock_.non_blocking(true);
+	on_socket_connected();
+	received_ = 0;
+	consumed_ = 0;
+	expected_ = 0;
+}
+
+template <class Protocol>
+inline void socket_stream<Protocol>::receive(void** ppd, size_t& sz)
+{
+	sz = 0;
+
+	bool complete = framing_ == framing_mode::length ? receive_length(sz) : receive_nul(sz);
+
+	if (complete)
+	{
+		*ppd = buf_.data();
+		on_socket_read(sz);
+	}
+}
+
+template <class Protocol>
+inline bool socket_stream<Protocol>::receive_nul(size_t& sz)
+{
+	asio::error_code ec;
+
+	if (consumed_ != 0)
+	{
+		std::memmove(buf_.data(), buf_.data() + consumed_, received_ - consumed_);
+		received_ -= consumed_;
+		consumed_ = 0;
+	}
+
+	size_t scanned = 0;
+
+	while (true)
+	{
+		auto end = received_ == scanned ? nullptr :
+			static_cast<char*>(std::memchr(buf_.data() + scanned, '\0', received_ - scanned));
+		if (end != nullptr)
+		{
+			sz = end - buf_.data() + 1;
+			break;
+		}
+
+		scanned = received_;
+
+		if (buf_.capacity() - received_ < min_read_size)
+			buf_.reserve(std::max(buf_.capacity() * 2, received_ + min_read_size), received_);
+
+		size_t sz_part = sock_.read_some(asio::buffer(buf_.data() + received_,
+			buf_.capacity() - received_), ec);
+
+		if (ec == asio::error::would_block)
+		{
+			return false;
+		}
+
+		if (ec != asio::error_code())
+			asio::detail::throw_error(ec, "receive_from");
+
+		received_ += sz_part;
+	}
+
+	if (sz == received_)
+		received_ = 0;
+	else
+		consumed_ = sz;
+
+	return true;
+}
+
+template <class Protocol>
+inline bool socket_stream<Protocol>::receive_length(size_t& sz)
+{
+	asio::error_code ec;
+
+	while (received_ < frame_header_size)
+	{
+		size_t sz_part = sock_.read_some(asio::buffer(header_ + received_,
+			frame_header_size - received_), ec);
+
+		if (ec == asio::error::would_block)
+			return false;
+
+		if (ec != asio::error_code())
+			asio::detail::throw_error(ec, "receive_from");
+
+		received_ += sz_part;
+
+		if (received_ == frame_header_size)
+		{
+			expected_ = read_frame_header(header_, max_frame_size_);
+			buf_.reserve(expected_ + 1);
+		}
+	}
+
+	while (received_ < frame_header_size + expected_)
+	{
+		size_t offset = received_ - frame_header_size;
+		size_t sz_part = sock_.read_some(asio::buffer(buf_.data() + offset,
+			expected_ - offset), ec);
+
+		if (ec == asio::error::would_block)
+			return false;
+
+		if (ec != asio::error_code())
+			asio::detail::throw_error(ec, "receive_from");
+
+		received_ += sz_part;
+	}
+
+	buf_.data()[expected_] = '\0';
+	sz = expected_;
+
+	received_ = 0;
+	expected_ = 0;
+
+	return true;
+}
+
+template <class Protocol>
+inline void socket_stream<Protocol>::send(const void* pd, size_t sz)
+{
+	wait_write();
+	out_bufs_.clear();
+
+	if (framing_ == framing_mode::nul)
+	{
+		out_bufs_.push_back(asio::buffer(pd, sz));
+		write_all();
+		return;
+	}
+
+	if (sz > 0 && static_cast<const char*>(pd)[sz - 1] == '\0')
+		sz--;
+
+	write_frame_header(header_out_, sz);
+
+	out_bufs_.push_back(asio::buffer(header_out_, frame_header_size));
+	out_bufs_.push_back(asio::buffer(pd, sz));
+	write_all();
+}
+
+template <class Protocol>
+inline void socket_stream<Protocol>::send_gather(const send_buffer* bufs, size_t count)
+{
+	wait_write();
+	out_bufs_.clear();
+
+	size_t sz = 0;
+	for (size_t i = 0; i < count; i++)
+		sz += bufs[i].size;
+
+	if (framing_ == framing_mode::length)
+	{
+		write_frame_header(header_out_, sz);
+		out_bufs_.push_back(asio::buffer(header_out_, frame_header_size));
+	}
+
+	for (size_t i = 0; i < count; i++)
+	{
+		if (bufs[i].size != 0)
+			out_bufs_.push_back(asio::buffer(bufs[i].data, bufs[i].size));
+	}
+
+	if (framing_ == framing_mode::nul)
+		out_bufs_.push_back(asio::buffer(&nul_, 1));
+
+	write_all();
+}
+
+// Writes out_bufs_ with as few system calls as the socket allows. What the
+// socket buffer can't take is copied out and finished by async_write, so a
+// slow reader doesn't hold up the loop; the next send on the stream waits
+// for it.
+template <class Protocol>
+inline void socket_stream<Protocol>::write_all()
+{
+	auto& bufs = out_bufs_;
+	size_t left = asio::buffer_size(bufs);
+
+	while (left > 0)
+	{
+		asio::error_code ec;
+		size_t sz_part = sock_.write_some(bufs, ec);
+
+		if (ec == asio::error::would_block)
+			break;
+
+		if (ec != asio::error_code())
+			asio::detail::throw_error(ec, "send");
+
+		left -= sz_part;
+
+		// drop the written buffers, asio only takes the first few of a sequence
+		auto b = bufs.begin();
+		for (; b != bufs.end() && sz_part >= b->size(); ++b)
+			sz_part -= b->size();
+
+		if (b != bufs.end())
+			*b += sz_part;
+
+		bufs.erase(bufs.begin(), b);
+	}
+
+	if (left == 0)
+		return;
+
+	out_rest_.reserve(left);
+	asio::buffer_copy(asio::buffer(out_rest_.data(), left), bufs);
+
+	writing_ = true;
+	asio::async_write(sock_, asio::buffer(out_rest_.data(), left), bind_memory(write_memory_,
+		[this](const asio::error_code& ec, size_t)
+		{
+			writing_ = false;
+			if (ec != asio::error::operation_aborted)
+				write_error_ = ec;
+		}));
+}
+
+template <class Protocol>
+inline void socket_stream<Protocol>::wait_write()
+{
+	if (writing_)
+		loop_.run_until([this]() { return !writing_; });
+
+	if (write_error_ != asio::error_code())
+	{
+		auto ec = write_error_;
+		write_error_ = asio::error_code();
+		asio::detail::throw_error(ec, "send");
+	}
+}
+
+template <class Protocol>
+inline bool socket_stream<Protocol>::is_connected() const
+{
+	return sock_.is_open();
+}
+
+template <class Protocol>
+inline void socket_stream<Protocol>::on_readable(std::function<void()> handler)
+{
+	if (consumed_ != 0)
+	{
+		asio::post(loop_.service(), bind_memory(wait_memory_, std::move(handler)));
+		return;
+	}
+
+	sock_.async_wait(socket_type::wait_read, bind_memory(wait_memory_,
+		[handler = std::move(handler)](const asio::error_code&) { handler(); }));
+}
+
+template <class Protocol>
+inline void socket_stream<Protocol>::wait_readable()
+{
+	bool readable = false;
+	on_readable([&readable]() { readable = true; });
+	loop_.run_until([&readable]() { return readable; });
+}
+
+template <class Protocol>
+inline void socket_stream<Protocol>::wait() {
+	if (listener_)
+		listener_->accept(sock_);
+	else if (server_)
+		accept_socket(loop_, acceptor_, sock_);
+	else
+		return;
+
+	on_connected();
+}
+
+template <class Protocol>
+inline void socket_stream<Protocol>::disconnect()
+{
+	if (writing_ && sock_.is_open())
+		wait_write();
+
+	sock_.close();
+	buf_.reset();
+}
+
+template <class Protocol>
+inline void socket_stream<Protocol>::close()
+{
+	if (acceptor_.is_open())
+		acceptor_.close();
+	sock_.close();
+	buf_.reset();
+	out_rest_.reset();
+	write_error_ = asio::error_code();
+}
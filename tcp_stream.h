@@ -1,185 +1,219 @@
 #pragma once
 
-#include "remote_env.h"
+#include "socket_stream.h"
+#include "uri.h"
 
-#define ASIO_STANDALONE
-#include <asio.hpp>
-#include <cstring>
-#include <limits>
+#if !defined(_WIN32)
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#endif
 
 using asio::ip::tcp;
 
-class tcp_stream : public base_stream
+// Per-connection socket options taken from the URI query, e.g.
+// tcp://host:port?nodelay=1&sndbuf=4M&rcvbuf=4M&quickack=1&busy_poll=50
+struct tcp_options
 {
-	asio::io_service io_service_;
-	tcp::socket sock_;
-	tcp::acceptor acceptor_;
-	void* buf_;
-	size_t buf_size_;
-	bool server_;
-	std::string host_;
-	std::string port_;
-	size_t static const max_internal_buffer = 16384;
-
-public:
-	explicit tcp_stream(size_t buf_size);
-	tcp_stream(std::string host, std::string port, size_t buf_size);
-	tcp_stream(const tcp_stream&) = delete;
-
-	tcp_stream& operator =(const tcp_stream& a) = delete;
-	~tcp_stream();
-	void receive(void** ppd, size_t& sz) override;
-	void send(const void* pd, size_t sz) override;
-	bool is_connected() const override;
-	void connect() override;
+	bool nodelay{ false };
+	int sndbuf{ 0 };
+	int rcvbuf{ 0 };
+	bool quickack{ false };
+	int busy_poll{ 0 };
 
-	void create() override;
-	void wait() override;
-	void disconnect() override;
-	void close() override;
+	static tcp_options parse(const connection_uri& uri);
 };
 
-inline tcp_stream::tcp_stream(std::string host, std::string port, size_t buf_size)
-	: sock_(io_service_), acceptor_(io_service_), buf_size_(buf_size), server_(false),
-	host_(host), port_(port)
+inline tcp_options tcp_options::parse(const connection_uri& uri)
 {
-	buf_ = new char[buf_size];
+	tcp_options res;
+	res.nodelay = parse_flag_param("nodelay", uri.param("nodelay"));
+	res.sndbuf = parse_size_param("sndbuf", uri.param("sndbuf"));
+	res.rcvbuf = parse_size_param("rcvbuf", uri.param("rcvbuf"));
+	res.quickack = parse_flag_param("quickack", uri.param("quickack"));
+	res.busy_poll = parse_size_param("busy_poll", uri.param("busy_poll"));
+	return res;
 }
 
-inline tcp_stream::~tcp_stream()
+inline tcp::endpoint tcp_listen_endpoint(const std::string& port)
 {
-	delete[] static_cast<char*>(buf_);
+	int port_num;
+
+	try
+	{
+		port_num = std::stoi(port.c_str());
+	}
+	catch (std::invalid_argument&)
+	{
+		throw std::invalid_argument("tcp error: invalid port");
+	}
+
+	if (port_num < 0 || port_num > std::numeric_limits<unsigned short>::max())
+		throw std::invalid_argument("tcp error: invalid port");
+
+	return tcp::endpoint(tcp::v4(), static_cast<unsigned short>(port_num));
 }
 
-inline void tcp_stream::receive(void** ppd, size_t& sz)
+class tcp_listener : public socket_listener<tcp>
 {
-	asio::error_code ec;
-	sz = 0;
-	size_t sz_part;
+	std::string port_;
 
-	sz_part = sock_.read_some(asio::buffer(buf_, max_internal_buffer), ec);
+public:
+	tcp_listener(event_loop& loop, std::string port)
+		: socket_listener(loop), port_(port)
+	{
+	}
 
-	if (ec == asio::error::would_block)
+	void create() override
 	{
-		sz = 0;
-		return;
+		close();
+		acceptor_ = tcp::acceptor(loop_.service(), tcp_listen_endpoint(port_));
 	}
+};
 
-	if (ec != asio::error_code())
-		asio::detail::throw_error(ec, "receive_from");
+class tcp_stream : public socket_stream<tcp>
+{
+	std::string host_;
+	std::string port_;
+	tcp_options options_;
+	size_t mss_{ 0 };
 
-	sz = sz_part;
+	void set_quickack();
 
-	if (static_cast<char*>(buf_)[sz_part - 1] != '\0')
-	{
-		auto part_start = static_cast< char* >(buf_);
-		try
-		{
-			do
-			{
-				part_start += sz_part;
-				sz_part = sock_.read_some(asio::buffer(part_start, max_internal_buffer), ec);
-				if (ec == asio::error::would_block)
-				{
-					//TODO: add some sleep here
-					sz_part = 0;
-					continue;
-				}
-				sz += sz_part;
-				if (sz + max_internal_buffer > buf_size_)
-					throw std::runtime_error("receive buffer overflow");
-			} while (static_cast<char*>(part_start)[sz_part - 1] != '\0');
-		}
-		catch (std::exception&)
-		{
-			throw;
-		}
+protected:
+	void on_socket_connected() override;
+	void on_socket_read(size_t sz) override;
 
-	}
+public:
+	tcp_stream(event_loop& loop, buffer_pool& pool, std::string host, std::string port,
+		framing_mode framing = framing_mode::nul, tcp_options options = tcp_options());
 
-	*ppd = buf_;
-}
+	void connect() override;
+	void create() override;
 
-inline void tcp_stream::send(const void* pd, size_t sz)
-{
-	asio::write(sock_, asio::buffer(static_cast< const char* >(pd), sz));
-}
+	// Options of the connected socket as the kernel reports them back.
+	std::string describe_options() const;
+};
 
-inline bool tcp_stream::is_connected() const
+inline tcp_stream::tcp_stream(event_loop& loop, buffer_pool& pool, std::string host, std::string port,
+	framing_mode framing, tcp_options options)
+	: socket_stream(loop, pool, framing), host_(host), port_(port), options_(options)
 {
-	return sock_.is_open();
 }
 
-inline void tcp_stream::connect()
+inline void tcp_stream::on_socket_connected()
 {
-	server_ = false;
+	if (options_.nodelay)
+		sock_.set_option(tcp::no_delay(true));
+	if (options_.sndbuf != 0)
+		sock_.set_option(asio::socket_base::send_buffer_size(options_.sndbuf));
+	if (options_.rcvbuf != 0)
+		sock_.set_option(asio::socket_base::receive_buffer_size(options_.rcvbuf));
+
+	if (options_.busy_poll != 0)
+	{
+#if defined(SO_BUSY_POLL)
+		sock_.set_option(asio::detail::socket_option::integer<SOL_SOCKET, SO_BUSY_POLL>(
+			options_.busy_poll));
+#else
+		throw std::invalid_argument("tcp error: busy_poll isn't supported on this platform");
+#endif
+	}
 
-	sock_ = tcp::socket(io_service_);
+	mss_ = 0;
 
-	tcp::resolver resolver(io_service_);
-	tcp::resolver::query query(host_, port_);
-	tcp::resolver::iterator endpoint_iterator = resolver.resolve(query);
+#if defined(TCP_MAXSEG)
+	asio::detail::socket_option::integer<IPPROTO_TCP, TCP_MAXSEG> mss;
+	asio::error_code ec;
+	sock_.get_option(mss, ec);
+	if (!ec && mss.value() > 0)
+		mss_ = static_cast<size_t>(mss.value());
+#endif
 
-	asio::connect(sock_, endpoint_iterator);
+	set_quickack();
+}
 
+// The kernel drops back to delayed ACKs on its own, so quickack has to be
+// re-armed, at the cost of a setsockopt per call. A delayed ACK only stalls
+// the peer on packets that span several segments, where Nagle holds the last
+// one back until the others are acknowledged, so only those re-arm it.
+inline void tcp_stream::on_socket_read(size_t sz)
+{
+	if (sz > mss_)
+		set_quickack();
 }
 
-inline void tcp_stream::create()
+inline void tcp_stream::set_quickack()
 {
-	if (acceptor_.is_open())
-		acceptor_.close();
+	if (!options_.quickack)
+		return;
 
-	int port_num;
+#if defined(TCP_QUICKACK)
+	sock_.set_option(asio::detail::socket_option::integer<IPPROTO_TCP, TCP_QUICKACK>(1));
+#else
+	throw std::invalid_argument("tcp error: quickack isn't supported on this platform");
+#endif
+}
 
-	try
-	{
-		port_num = std::stoi(port_.c_str());
-	}
-	catch (std::invalid_argument&)
-	{
-		throw std::invalid_argument("tcp error: invalid port");
-	}
+inline std::string tcp_stream::describe_options() const
+{
+	std::string res;
+	asio::error_code ec;
 
-	if (port_num < 0 || port_num > std::numeric_limits<unsigned short>::max())
-		throw std::invalid_argument("tcp error: invalid port");
+	tcp::no_delay nodelay;
+	sock_.get_option(nodelay, ec);
+	if (!ec)
+		res += std::string(" nodelay=") + (nodelay.value() ? "1" : "0");
 
-	acceptor_ = tcp::acceptor(io_service_, tcp::endpoint(tcp::v4(),
-		static_cast<unsigned short>(port_num)));
+	asio::socket_base::send_buffer_size sndbuf;
+	sock_.get_option(sndbuf, ec);
+	if (!ec)
+		res += " sndbuf=" + std::to_string(sndbuf.value());
 
-	acceptor_.non_blocking(true);
-	server_ = true;
-}
+	asio::socket_base::receive_buffer_size rcvbuf;
+	sock_.get_option(rcvbuf, ec);
+	if (!ec)
+		res += " rcvbuf=" + std::to_string(rcvbuf.value());
 
-inline void tcp_stream::wait() {
-	if (!server_)
-		return;
+	if (options_.quickack)
+		res += " quickack";
 
-	asio::error_code ec;
-	sock_ = tcp::socket(io_service_);
-	while (true)
-	{
-		acceptor_.accept(sock_, ec);
-		if (ec == asio::error::would_block)
-		{
-			continue;
-		}
-		if (ec != asio::error_code())
-		{
-			asio::detail::throw_error(ec, "receive_from");
-		}
-		break;
-	}
+#if defined(SO_BUSY_POLL)
+	asio::detail::socket_option::integer<SOL_SOCKET, SO_BUSY_POLL> busy_poll;
+	sock_.get_option(busy_poll, ec);
+	if (!ec)
+		res += " busy_poll=" + std::to_string(busy_poll.value()) + "us";
+#endif
+
+	if (mss_ != 0)
+		res += " mss=" + std::to_string(mss_);
+
+	return res.empty() ? std::string("unknown") : res.substr(1);
 }
 
-inline void tcp_stream::disconnect()
+inline void tcp_stream::connect()
 {
-	sock_.close();
+	server_ = false;
+
+	sock_ = tcp::socket(loop_.service());
+
+	tcp::resolver resolver(loop_.service());
+	tcp::resolver::query query(host_, port_);
+	tcp::resolver::iterator endpoint_iterator = resolver.resolve(query);
+
+	asio::connect(sock_, endpoint_iterator);
+
+	on_connected();
 }
 
-inline void tcp_stream::close()
+inline void tcp_stream::create()
 {
+	if (listener_)
+		return;
+
 	if (acceptor_.is_open())
 		acceptor_.close();
-	sock_.close();
-}
 
+	acceptor_ = tcp::acceptor(loop_.service(), tcp_listen_endpoint(port_));
+
+	server_ = true;
+}
@@ -0,0 +1,146 @@
+// Loopback check that the per-tick stream I/O doesn't allocate: a client
+// thread plays the environments, the main thread receives and answers them
+// the way multi_env::work does, and the ticks are counted with
+// tick_allocations. Runs over plain sockets, and over io_uring where the
+// kernel supports it. Exits with 1 if a tick after warm-up allocated.
+//
+//   make test_tick_allocs && ./test_tick_allocs
+
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "alloc_counter.h"
+#include "tcp_stream.h"
+#include "uring_stream.h"
+
+static const int env_count = 8;
+static const int tick_count = 200;
+
+static bool run(const char* name, unsigned short port, bool use_uring)
+{
+	event_loop loop;
+	buffer_pool pool;
+#if defined(MULTI_ENV_HAS_IO_URING)
+	std::unique_ptr<uring> ring;
+	if (use_uring)
+		ring = std::make_unique<uring>(loop);
+#endif
+	std::vector<std::unique_ptr<tcp_stream>> envs;
+
+	for (int i = 0; i < env_count; i++)
+	{
+		std::string env_port = std::to_string(port + i);
+#if defined(MULTI_ENV_HAS_IO_URING)
+		if (ring)
+			envs.emplace_back(std::make_unique<uring_stream>(loop, pool, *ring, "127.0.0.1",
+				env_port, framing_mode::length));
+		else
+#endif
+			envs.emplace_back(std::make_unique<tcp_stream>(loop, pool, "127.0.0.1", env_port,
+				framing_mode::length));
+
+		envs.back()->create();
+	}
+
+	std::thread client([port]()
+	{
+		event_loop loop;
+		buffer_pool pool;
+		std::vector<std::unique_ptr<tcp_stream>> peers;
+
+		for (int i = 0; i < env_count; i++)
+		{
+			peers.emplace_back(std::make_unique<tcp_stream>(loop, pool, "127.0.0.1",
+				std::to_string(port + i), framing_mode::length));
+			peers.back()->connect();
+		}
+
+		// the packets grow over the run, which has to count as warm-up
+		std::string packet;
+		packet.reserve(64 + tick_count * 97);
+		for (int t = 0; t < tick_count; t++)
+		{
+			packet.assign(64 + t * 97, 'x');
+			for (auto& p : peers)
+				p->send(packet.data(), packet.size());
+
+			for (auto& p : peers)
+			{
+				void* pd;
+				size_t sz;
+				p->receive_wait(&pd, sz);
+			}
+		}
+
+		for (auto& p : peers)
+			p->disconnect();
+	});
+
+	for (auto& env : envs)
+		env->wait();
+
+	tick_allocations ticks;
+	std::vector<size_t> readable;
+	readable.reserve(env_count);
+
+	for (int t = 0; t < tick_count; t++)
+	{
+		ticks.next(false);
+
+		for (int i = 0; i < env_count; i++)
+			envs[i]->on_readable([&readable, i]() { readable.push_back(i); });
+
+		int received = 0;
+		while (received < env_count)
+		{
+			loop.run_until([&readable]() { return !readable.empty(); });
+
+			for (auto i : readable)
+			{
+				void* pd;
+				size_t sz;
+				envs[i]->receive(&pd, sz);
+
+				if (sz == 0)
+					envs[i]->on_readable([&readable, i]() { readable.push_back(i); });
+				else
+					received++;
+			}
+
+			readable.clear();
+		}
+
+		for (auto& env : envs)
+			env->send("ack", 4);
+	}
+
+	ticks.next(false);
+
+	for (auto& env : envs)
+		env->close();
+	client.join();
+
+	std::printf("%-8s allocations: %llu in %zu of %zu ticks after warm-up, %zu more grew buffers\n",
+		name, static_cast<unsigned long long>(ticks.allocations()), ticks.allocating_ticks(),
+		ticks.ticks(), ticks.growing_ticks());
+
+	return ticks.allocating_ticks() == 0;
+}
+
+int main()
+{
+	bool ok = run("tcp", 17500, false);
+
+#if defined(MULTI_ENV_HAS_IO_URING)
+	if (uring::available())
+		ok = run("io_uring", 17600, true) && ok;
+	else
+		std::printf("io_uring isn't available, skipped\n");
+#endif
+
+	return ok ? 0 : 1;
+}
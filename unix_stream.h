@@ -0,0 +1,97 @@
+#pragma once
+
+#include "socket_stream.h"
+
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+
+#include <cstdio>
+
+using unix_socket = asio::local::stream_protocol;
+
+class unix_listener : public socket_listener<unix_socket>
+{
+	std::string path_;
+
+public:
+	unix_listener(event_loop& loop, std::string path)
+		: socket_listener(loop), path_(path)
+	{
+	}
+
+	void create() override
+	{
+		close();
+
+		if (path_.empty())
+			throw std::invalid_argument("unix error: empty socket path");
+
+		std::remove(path_.c_str());
+		acceptor_ = unix_socket::acceptor(loop_.service(), unix_socket::endpoint(path_));
+	}
+
+	void close() override
+	{
+		if (!acceptor_.is_open())
+			return;
+
+		acceptor_.close();
+		std::remove(path_.c_str());
+	}
+};
+
+class unix_stream : public socket_stream<unix_socket>
+{
+	std::string path_;
+
+public:
+	unix_stream(event_loop& loop, buffer_pool& pool, std::string path,
+		framing_mode framing = framing_mode::nul);
+
+	void connect() override;
+	void create() override;
+	void close() override;
+};
+
+inline unix_stream::unix_stream(event_loop& loop, buffer_pool& pool, std::string path,
+	framing_mode framing)
+	: socket_stream(loop, pool, framing), path_(path)
+{
+}
+
+inline void unix_stream::connect()
+{
+	server_ = false;
+
+	sock_ = unix_socket::socket(loop_.service());
+	sock_.connect(unix_socket::endpoint(path_));
+
+	on_connected();
+}
+
+inline void unix_stream::create()
+{
+	if (listener_)
+		return;
+
+	if (acceptor_.is_open())
+		acceptor_.close();
+
+	if (path_.empty())
+		throw std::invalid_argument("unix error: empty socket path");
+
+	std::remove(path_.c_str());
+
+	acceptor_ = unix_socket::acceptor(loop_.service(), unix_socket::endpoint(path_));
+
+	server_ = true;
+}
+
+inline void unix_stream::close()
+{
+	socket_stream::close();
+
+	if (server_)
+		std::remove(path_.c_str());
+}
+
+#endif
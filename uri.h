@@ -0,0 +1,131 @@
+#pragma once
+
+#include <cctype>
+#include <limits>
+#include <map>
+#include <stdexcept>
+#include <string>
+
+struct connection_uri
+{
+	std::string scheme;
+	std::string address;
+	std::string query;
+	std::map<std::string, std::string> params;
+
+	static connection_uri parse(const std::string& uri);
+
+	std::string param(const std::string& name, const std::string& def = std::string()) const
+	{
+		auto it = params.find(name);
+		return it == params.end() ? def : it->second;
+	}
+
+	// URI handed to a spawned env: only the parameters both ends must agree on
+	// are kept, the multiplexer's own socket and I/O options are dropped.
+	std::string with_address(const std::string& addr, const std::string& extra = std::string()) const
+	{
+		std::string q;
+
+		for (auto name : { "framing" })
+		{
+			auto it = params.find(name);
+			if (it != params.end())
+				q += (q.empty() ? "" : "&") + it->first + "=" + it->second;
+		}
+
+		if (!extra.empty())
+			q += (q.empty() ? "" : "&") + extra;
+
+		return scheme + "://" + addr + (q.empty() ? std::string() : "?" + q);
+	}
+};
+
+inline connection_uri connection_uri::parse(const std::string& uri)
+{
+	connection_uri res;
+
+	auto colon_ind = uri.find("://");
+	if (colon_ind == std::string::npos)
+		throw std::invalid_argument("couldn't parse connection URI");
+
+	res.scheme = uri.substr(0, colon_ind);
+
+	auto rest = uri.substr(colon_ind + 3);
+	auto query_ind = rest.find('?');
+
+	res.address = rest.substr(0, query_ind);
+
+	if (query_ind == std::string::npos)
+		return res;
+
+	res.query = rest.substr(query_ind + 1);
+
+	size_t pos = 0;
+	while (pos <= res.query.size())
+	{
+		auto end = res.query.find('&', pos);
+		if (end == std::string::npos)
+			end = res.query.size();
+
+		auto item = res.query.substr(pos, end - pos);
+		if (!item.empty())
+		{
+			auto eq_ind = item.find('=');
+			if (eq_ind == 0)
+				throw std::invalid_argument("couldn't parse connection URI parameter '" + item + "'");
+
+			if (eq_ind == std::string::npos)
+				res.params[item] = "1";
+			else
+				res.params[item.substr(0, eq_ind)] = item.substr(eq_ind + 1);
+		}
+
+		pos = end + 1;
+	}
+
+	return res;
+}
+
+inline bool parse_flag_param(const std::string& name, const std::string& value)
+{
+	if (value == "1" || value == "true")
+		return true;
+	if (value.empty() || value == "0" || value == "false")
+		return false;
+
+	throw std::invalid_argument("invalid value '" + value + "' for URI parameter " + name);
+}
+
+inline int parse_size_param(const std::string& name, const std::string& value)
+{
+	if (value.empty())
+		return 0;
+
+	size_t pos = 0;
+	long long res;
+
+	try
+	{
+		res = std::stoll(value, &pos);
+	}
+	catch (std::logic_error&)
+	{
+		throw std::invalid_argument("invalid value '" + value + "' for URI parameter " + name);
+	}
+
+	if (pos + 1 == value.size())
+	{
+		switch (std::toupper(static_cast<unsigned char>(value[pos])))
+		{
+		case 'K': res <<= 10; pos++; break;
+		case 'M': res <<= 20; pos++; break;
+		case 'G': res <<= 30; pos++; break;
+		}
+	}
+
+	if (pos != value.size() || res < 0 || res > std::numeric_limits<int>::max())
+		throw std::invalid_argument("invalid value '" + value + "' for URI parameter " + name);
+
+	return static_cast<int>(res);
+}
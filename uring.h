@@ -0,0 +1,372 @@
+#pragma once
+
+#include "event_loop.h"
+
+#if defined(__linux__) && defined(ASIO_HAS_POSIX_STREAM_DESCRIPTOR) && __has_include(<linux/io_uring.h>)
+
+#define MULTI_ENV_HAS_IO_URING 1
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Completion target of one io_uring operation. An op may be in flight at most
+// once, and must stay alive until it completes.
+struct uring_op
+{
+	std::function<void(int)> complete;
+	bool pending{ false };
+};
+
+// io_uring instance shared by all streams of the multiplexer. Operations
+// queued while handling one event are submitted together by a single
+// io_uring_enter once the event loop gets control back. Completions are
+// signalled through an eventfd that the event loop waits on.
+class uring
+{
+	event_loop& loop_;
+	int fd_{ -1 };
+	asio::posix::stream_descriptor bell_;
+
+	void* sq_ring_{ nullptr };
+	void* cq_ring_{ nullptr };
+	std::size_t sq_ring_sz_{ 0 };
+	std::size_t cq_ring_sz_{ 0 };
+	io_uring_sqe* sqes_{ nullptr };
+	std::size_t sqes_sz_{ 0 };
+
+	unsigned sq_entries_{ 0 };
+	unsigned* sq_head_{ nullptr };
+	unsigned* sq_tail_{ nullptr };
+	unsigned* sq_mask_{ nullptr };
+	unsigned* sq_array_{ nullptr };
+	unsigned* cq_head_{ nullptr };
+	unsigned* cq_tail_{ nullptr };
+	unsigned* cq_mask_{ nullptr };
+	io_uring_cqe* cqes_{ nullptr };
+
+	unsigned queued_{ 0 };
+	std::size_t in_flight_{ 0 };
+	bool flush_posted_{ false };
+	bool waiting_{ false };
+	handler_memory flush_memory_;
+	handler_memory bell_memory_;
+
+	void queue(const io_uring_sqe& sqe);
+	void reap();
+	void arm();
+	void unmap();
+
+	static int setup(unsigned entries, io_uring_params& params)
+	{
+		return static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+	}
+
+	static int enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+	{
+		return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			flags, nullptr, 0));
+	}
+
+	static int register_ring(int fd, unsigned opcode, const void* arg, unsigned nr_args)
+	{
+		return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+	}
+
+public:
+	// Whether the kernel supports io_uring with socket send and receive.
+	static bool available();
+
+	explicit uring(event_loop& loop, unsigned entries = 4096);
+	uring(const uring&) = delete;
+	uring& operator=(const uring&) = delete;
+	~uring();
+
+	void send(int fd, const void* pd, std::size_t sz, uring_op& op);
+	void recv(int fd, void* pd, std::size_t sz, uring_op& op);
+	void cancel(uring_op& op);
+	void submit();
+};
+
+inline bool uring::available()
+{
+	io_uring_params params;
+	std::memset(&params, 0, sizeof(params));
+
+	int fd = setup(2, params);
+	if (fd < 0)
+		return false;
+
+	std::vector<char> probe_buf(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+	auto probe = reinterpret_cast<io_uring_probe*>(probe_buf.data());
+
+	bool res = register_ring(fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+		probe->last_op >= IORING_OP_RECV &&
+		(probe->ops[IORING_OP_SEND].flags & IO_URING_OP_SUPPORTED) != 0 &&
+		(probe->ops[IORING_OP_RECV].flags & IO_URING_OP_SUPPORTED) != 0 &&
+		(probe->ops[IORING_OP_ASYNC_CANCEL].flags & IO_URING_OP_SUPPORTED) != 0;
+
+	::close(fd);
+	return res;
+}
+
+inline uring::uring(event_loop& loop, unsigned entries)
+	: loop_(loop), bell_(loop.service())
+{
+	io_uring_params params;
+	std::memset(&params, 0, sizeof(params));
+
+	fd_ = setup(entries, params);
+	if (fd_ < 0)
+		throw std::runtime_error("io_uring error: setup failed");
+
+	sq_ring_sz_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_ring_sz_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+	bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single_mmap)
+		sq_ring_sz_ = cq_ring_sz_ = std::max(sq_ring_sz_, cq_ring_sz_);
+
+	sq_ring_ = mmap(nullptr, sq_ring_sz_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		fd_, IORING_OFF_SQ_RING);
+	if (sq_ring_ == MAP_FAILED)
+	{
+		sq_ring_ = nullptr;
+		unmap();
+		throw std::runtime_error("io_uring error: couldn't map submission ring");
+	}
+
+	cq_ring_ = single_mmap ? sq_ring_ : mmap(nullptr, cq_ring_sz_, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+	if (cq_ring_ == MAP_FAILED)
+	{
+		cq_ring_ = nullptr;
+		unmap();
+		throw std::runtime_error("io_uring error: couldn't map completion ring");
+	}
+
+	sqes_sz_ = params.sq_entries * sizeof(io_uring_sqe);
+	void* sqes = mmap(nullptr, sqes_sz_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		fd_, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+	{
+		unmap();
+		throw std::runtime_error("io_uring error: couldn't map submission entries");
+	}
+	sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+	auto sq = static_cast<char*>(sq_ring_);
+	auto cq = static_cast<char*>(cq_ring_);
+
+	sq_entries_ = params.sq_entries;
+	sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+	sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+	sq_mask_ = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+	sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+	cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+	cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+	cq_mask_ = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+	cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+	int efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (efd < 0)
+	{
+		unmap();
+		throw std::runtime_error("io_uring error: couldn't create eventfd");
+	}
+
+	bell_.assign(efd);
+
+	if (register_ring(fd_, IORING_REGISTER_EVENTFD, &efd, 1) != 0)
+	{
+		unmap();
+		throw std::runtime_error("io_uring error: couldn't register eventfd");
+	}
+}
+
+inline uring::~uring()
+{
+	unmap();
+}
+
+inline void uring::unmap()
+{
+	if (bell_.is_open())
+		bell_.close();
+
+	if (sqes_)
+		munmap(sqes_, sqes_sz_);
+	if (cq_ring_ && cq_ring_ != sq_ring_)
+		munmap(cq_ring_, cq_ring_sz_);
+	if (sq_ring_)
+		munmap(sq_ring_, sq_ring_sz_);
+
+	sqes_ = nullptr;
+	cq_ring_ = sq_ring_ = nullptr;
+
+	if (fd_ >= 0)
+		::close(fd_);
+	fd_ = -1;
+}
+
+inline void uring::queue(const io_uring_sqe& sqe)
+{
+	unsigned tail = *sq_tail_;
+
+	if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) == sq_entries_)
+	{
+		submit();
+		if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) == sq_entries_)
+			throw std::runtime_error("io_uring error: submission queue is full");
+	}
+
+	unsigned index = tail & *sq_mask_;
+	sqes_[index] = sqe;
+	sq_array_[index] = index;
+	__atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+
+	queued_++;
+	in_flight_++;
+
+	if (!flush_posted_)
+	{
+		flush_posted_ = true;
+		asio::post(loop_.service(), bind_memory(flush_memory_, [this]()
+		{
+			flush_posted_ = false;
+			submit();
+		}));
+	}
+}
+
+inline void uring::send(int fd, const void* pd, std::size_t sz, uring_op& op)
+{
+	io_uring_sqe sqe;
+	std::memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_SEND;
+	sqe.fd = fd;
+	sqe.addr = reinterpret_cast<std::uint64_t>(pd);
+	sqe.len = static_cast<std::uint32_t>(std::min<std::size_t>(sz, UINT32_MAX));
+	sqe.msg_flags = MSG_NOSIGNAL;
+	sqe.user_data = reinterpret_cast<std::uint64_t>(&op);
+
+	op.pending = true;
+	queue(sqe);
+}
+
+inline void uring::recv(int fd, void* pd, std::size_t sz, uring_op& op)
+{
+	io_uring_sqe sqe;
+	std::memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_RECV;
+	sqe.fd = fd;
+	sqe.addr = reinterpret_cast<std::uint64_t>(pd);
+	sqe.len = static_cast<std::uint32_t>(std::min<std::size_t>(sz, UINT32_MAX));
+	sqe.user_data = reinterpret_cast<std::uint64_t>(&op);
+
+	op.pending = true;
+	queue(sqe);
+}
+
+inline void uring::cancel(uring_op& op)
+{
+	if (!op.pending)
+		return;
+
+	io_uring_sqe sqe;
+	std::memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_ASYNC_CANCEL;
+	sqe.fd = -1;
+	sqe.addr = reinterpret_cast<std::uint64_t>(&op);
+	sqe.user_data = 0;
+
+	queue(sqe);
+}
+
+inline void uring::submit()
+{
+	while (queued_ != 0)
+	{
+		int res = enter(fd_, queued_, 0, 0);
+
+		if (res < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN || errno == EBUSY)
+			{
+				// the completion queue is full: make room and retry
+				reap();
+				continue;
+			}
+
+			throw std::runtime_error(std::string("io_uring error: submit failed: ") +
+				std::strerror(errno));
+		}
+
+		queued_ -= static_cast<unsigned>(res);
+	}
+
+	arm();
+}
+
+inline void uring::arm()
+{
+	if (waiting_ || in_flight_ == 0)
+		return;
+
+	waiting_ = true;
+
+	bell_.async_wait(asio::posix::stream_descriptor::wait_read, bind_memory(bell_memory_,
+		[this](const asio::error_code& ec)
+		{
+			waiting_ = false;
+
+			if (ec)
+				return;
+
+			std::uint64_t count;
+			while (::read(bell_.native_handle(), &count, sizeof(count)) > 0)
+			{
+			}
+
+			reap();
+			arm();
+		}));
+}
+
+inline void uring::reap()
+{
+	while (true)
+	{
+		unsigned head = *cq_head_;
+		if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE))
+			break;
+
+		// copied out before the slot is released, completion handlers may queue more work
+		io_uring_cqe cqe = cqes_[head & *cq_mask_];
+		__atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+
+		in_flight_--;
+
+		if (cqe.user_data == 0)
+			continue;
+
+		auto op = reinterpret_cast<uring_op*>(cqe.user_data);
+		op->pending = false;
+		op->complete(cqe.res);
+	}
+}
+
+#endif
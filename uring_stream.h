@@ -0,0 +1,373 @@
+#pragma once
+
+#include "tcp_stream.h"
+#include "uring.h"
+
+#include <system_error>
+
+#if defined(MULTI_ENV_HAS_IO_URING)
+
+// TCP stream that moves packets through the shared io_uring instead of
+// read/write syscalls. Connection setup is left to tcp_stream. Outgoing packets
+// are copied into a stream-owned buffer, so send() returns before the data is
+// written; a send error is reported by the next call on the stream.
+
+class uring_stream : public tcp_stream
+{
+	uring& ring_;
+	uring_op recv_op_;
+	uring_op send_op_;
+
+	pooled_buffer out_;
+	size_t out_size_{ 0 };
+	size_t out_sent_{ 0 };
+
+	std::function<void()> handler_;
+	int error_{ 0 };
+	char saved_{ 0 };
+	bool has_saved_{ false };
+
+	size_t packet_end() const;
+	void compact();
+	void arm_recv();
+	void on_recv(int res);
+	void on_send(int res);
+	void notify();
+	void check_error() const;
+	void cancel_ops();
+	void wait_send();
+
+protected:
+	void on_socket_connected() override;
+
+public:
+	uring_stream(event_loop& loop, buffer_pool& pool, uring& ring, std::string host,
+		std::string port, framing_mode framing = framing_mode::nul, tcp_options options = tcp_options());
+	~uring_stream();
+
+	void receive(void** ppd, size_t& sz) override;
+	void send(const void* pd, size_t sz) override;
+	void send_gather(const send_buffer* bufs, size_t count) override;
+	void on_readable(std::function<void()> handler) override;
+	void wait_readable() override;
+
+	void disconnect() override;
+	void close() override;
+};
+
+inline uring_stream::uring_stream(event_loop& loop, buffer_pool& pool, uring& ring, std::string host,
+	std::string port, framing_mode framing, tcp_options options)
+	: tcp_stream(loop, pool, host, port, framing, options), ring_(ring), out_(pool)
+{
+	recv_op_.complete = [this](int res) { on_recv(res); };
+	send_op_.complete = [this](int res) { on_send(res); };
+}
+
+inline uring_stream::~uring_stream()
+{
+	try
+	{
+		cancel_ops();
+	}
+	catch (std::exception&)
+	{
+	}
+}
+
+inline void uring_stream::on_socket_connected()
+{
+	tcp_stream::on_socket_connected();
+
+	// io_uring hands EAGAIN back for non-blocking sockets instead of waiting for readiness
+	sock_.non_blocking(false);
+
+	error_ = 0;
+	has_saved_ = false;
+	out_size_ = 0;
+	out_sent_ = 0;
+}
+
+inline size_t uring_stream::packet_end() const
+{
+	if (framing_ == framing_mode::nul)
+	{
+		auto end = received_ == 0 ? nullptr :
+			static_cast<const char*>(std::memchr(buf_.data(), '\0', received_));
+		return end == nullptr ? 0 : end - buf_.data() + 1;
+	}
+
+	if (received_ < frame_header_size)
+		return 0;
+
+	size_t end = frame_header_size +
+		read_frame_header(reinterpret_cast<const unsigned char*>(buf_.data()), max_frame_size_);
+
+	return end <= received_ ? end : 0;
+}
+
+inline void uring_stream::compact()
+{
+	if (consumed_ == 0)
+		return;
+
+	if (has_saved_)
+	{
+		buf_.data()[consumed_] = saved_;
+		has_saved_ = false;
+	}
+
+	std::memmove(buf_.data(), buf_.data() + consumed_, received_ - consumed_);
+	received_ -= consumed_;
+	consumed_ = 0;
+}
+
+inline void uring_stream::arm_recv()
+{
+	if (recv_op_.pending || error_ != 0)
+		return;
+
+	compact();
+
+	size_t need = received_ + min_read_size;
+	if (framing_ == framing_mode::length && received_ >= frame_header_size)
+	{
+		need = std::max(need, frame_header_size +
+			read_frame_header(reinterpret_cast<const unsigned char*>(buf_.data()), max_frame_size_));
+	}
+
+	// one spare byte keeps room for the terminating NUL of a length-framed packet
+	if (buf_.capacity() < need + 1)
+		buf_.reserve(std::max(buf_.capacity() * 2, need + 1), received_);
+
+	ring_.recv(sock_.native_handle(), buf_.data() + received_,
+		buf_.capacity() - received_ - 1, recv_op_);
+}
+
+inline void uring_stream::on_recv(int res)
+{
+	if (res == -ECANCELED)
+		return;
+
+	if (res <= 0)
+	{
+		error_ = res == 0 ? ECONNRESET : -res;
+		notify();
+		return;
+	}
+
+	received_ += static_cast<size_t>(res);
+
+	size_t end;
+	try
+	{
+		end = packet_end();
+	}
+	catch (std::runtime_error&)
+	{
+		// receive() reads the same header and throws
+		notify();
+		return;
+	}
+
+	if (end != 0)
+		notify();
+	else
+		arm_recv();
+}
+
+inline void uring_stream::on_send(int res)
+{
+	if (res == -ECANCELED)
+		return;
+
+	if (res < 0)
+	{
+		error_ = -res;
+		notify();
+		return;
+	}
+
+	out_sent_ += static_cast<size_t>(res);
+
+	if (out_sent_ < out_size_)
+		ring_.send(sock_.native_handle(), out_.data() + out_sent_, out_size_ - out_sent_, send_op_);
+}
+
+inline void uring_stream::notify()
+{
+	if (!handler_)
+		return;
+
+	auto handler = std::move(handler_);
+	handler_ = nullptr;
+	handler();
+}
+
+inline void uring_stream::check_error() const
+{
+	if (error_ != 0)
+		throw std::system_error(error_, std::generic_category(), "io_uring");
+}
+
+inline void uring_stream::receive(void** ppd, size_t& sz)
+{
+	sz = 0;
+	check_error();
+
+	if (recv_op_.pending)
+		return;
+
+	compact();
+
+	size_t end = packet_end();
+	if (end == 0)
+	{
+		arm_recv();
+		return;
+	}
+
+	if (framing_ == framing_mode::nul)
+	{
+		*ppd = buf_.data();
+		sz = end;
+	}
+	else
+	{
+		// the payload is NUL-terminated in place, the overwritten byte is restored by compact()
+		if (end < received_)
+		{
+			saved_ = buf_.data()[end];
+			has_saved_ = true;
+		}
+
+		buf_.data()[end] = '\0';
+		*ppd = buf_.data() + frame_header_size;
+		sz = end - frame_header_size;
+	}
+
+	consumed_ = end;
+	on_socket_read(sz);
+}
+
+inline void uring_stream::wait_send()
+{
+	check_error();
+
+	if (send_op_.pending)
+		loop_.run_until([this]() { return !send_op_.pending || error_ != 0; });
+
+	check_error();
+}
+
+inline void uring_stream::send(const void* pd, size_t sz)
+{
+	wait_send();
+
+	size_t header = 0;
+	if (framing_ == framing_mode::length)
+	{
+		if (sz > 0 && static_cast<const char*>(pd)[sz - 1] == '\0')
+			sz--;
+		header = frame_header_size;
+	}
+
+	out_.reserve(header + sz);
+
+	if (header != 0)
+		write_frame_header(reinterpret_cast<unsigned char*>(out_.data()), sz);
+
+	std::memcpy(out_.data() + header, pd, sz);
+
+	out_size_ = header + sz;
+	out_sent_ = 0;
+
+	ring_.send(sock_.native_handle(), out_.data(), out_size_, send_op_);
+}
+
+// The send completes after the call returns, so the pieces are still copied
+// together into out_.
+inline void uring_stream::send_gather(const send_buffer* bufs, size_t count)
+{
+	wait_send();
+
+	size_t sz = 0;
+	for (size_t i = 0; i < count; i++)
+		sz += bufs[i].size;
+
+	size_t header = framing_ == framing_mode::length ? frame_header_size : 0;
+	size_t trailer = framing_ == framing_mode::nul ? 1 : 0;
+
+	out_.reserve(header + sz + trailer);
+
+	if (header != 0)
+		write_frame_header(reinterpret_cast<unsigned char*>(out_.data()), sz);
+
+	char* p = out_.data() + header;
+	for (size_t i = 0; i < count; i++)
+	{
+		if (bufs[i].size != 0)
+			std::memcpy(p, bufs[i].data, bufs[i].size);
+		p += bufs[i].size;
+	}
+
+	if (trailer != 0)
+		*p = '\0';
+
+	out_size_ = header + sz + trailer;
+	out_sent_ = 0;
+
+	ring_.send(sock_.native_handle(), out_.data(), out_size_, send_op_);
+}
+
+inline void uring_stream::on_readable(std::function<void()> handler)
+{
+	if (!recv_op_.pending)
+		compact();
+
+	if (error_ != 0 || (!recv_op_.pending && packet_end() != 0))
+	{
+		asio::post(loop_.service(), bind_memory(wait_memory_, std::move(handler)));
+		return;
+	}
+
+	handler_ = std::move(handler);
+	arm_recv();
+}
+
+inline void uring_stream::wait_readable()
+{
+	bool readable = false;
+	on_readable([&readable]() { readable = true; });
+	loop_.run_until([&readable]() { return readable; });
+}
+
+inline void uring_stream::cancel_ops()
+{
+	handler_ = nullptr;
+
+	// a queued send, e.g. the final stop packet, is finished rather than dropped
+	if (send_op_.pending)
+		loop_.run_until([this]() { return !send_op_.pending || error_ != 0; });
+
+	ring_.cancel(recv_op_);
+	ring_.cancel(send_op_);
+
+	if (recv_op_.pending || send_op_.pending)
+		loop_.run_until([this]() { return !recv_op_.pending && !send_op_.pending; });
+}
+
+inline void uring_stream::disconnect()
+{
+	cancel_ops();
+	tcp_stream::disconnect();
+	out_.reset();
+}
+
+inline void uring_stream::close()
+{
+	cancel_ops();
+	tcp_stream::close();
+	out_.reset();
+}
+
+#endif
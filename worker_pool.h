@@ -0,0 +1,108 @@
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A job run once per post. The poster owns it and keeps it alive until it has
+// run, so posting allocates nothing; a job is posted again only once it ran.
+struct worker_job
+{
+	worker_job* next{ nullptr };
+
+	virtual void run() = 0;
+
+protected:
+	~worker_job() = default;
+};
+
+class worker_pool
+{
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	worker_job* head_{ nullptr };
+	worker_job* tail_{ nullptr };
+	std::vector<std::thread> threads_;
+	bool stopping_{ false };
+
+	void run();
+
+public:
+	explicit worker_pool(size_t threads);
+	worker_pool(const worker_pool&) = delete;
+	worker_pool& operator=(const worker_pool&) = delete;
+	~worker_pool();
+
+	void post(worker_job& job);
+
+	size_t size() const
+	{
+		return threads_.size();
+	}
+};
+
+inline worker_pool::worker_pool(size_t threads)
+{
+	if (threads == 0)
+		threads = 1;
+
+	threads_.reserve(threads);
+	for (size_t i = 0; i < threads; i++)
+	{
+		threads_.emplace_back([this]() { run(); });
+	}
+}
+
+inline worker_pool::~worker_pool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stopping_ = true;
+	}
+
+	cv_.notify_all();
+
+	for (auto& t : threads_)
+	{
+		t.join();
+	}
+}
+
+inline void worker_pool::post(worker_job& job)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		job.next = nullptr;
+		if (tail_)
+			tail_->next = &job;
+		else
+			head_ = &job;
+		tail_ = &job;
+	}
+
+	cv_.notify_one();
+}
+
+inline void worker_pool::run()
+{
+	while (true)
+	{
+		worker_job* job;
+
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			cv_.wait(lock, [this]() { return stopping_ || head_ != nullptr; });
+
+			if (!head_)
+				return;
+
+			job = head_;
+			head_ = job->next;
+			if (!head_)
+				tail_ = nullptr;
+		}
+
+		job->run();
+	}
+}